@@ -0,0 +1,98 @@
+// make_test_models.cpp
+// writes synthetic TorchScript models, following nn_tilde's conventions
+// (<method>_params buffers, get_methods and get_attributes),
+// so that nn_bench can run without downloading real models.
+//
+// usage: nn_make_test_models <output directory>
+
+#include <torch/script.h>
+#include <torch/torch.h>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// in_dim, in_ratio, out_dim, out_ratio
+torch::Tensor methodParams(int inDim, int inRatio, int outDim, int outRatio) {
+  return torch::tensor({inDim, inRatio, outDim, outRatio}, torch::kInt);
+}
+
+// audio in, audio out: the lightest possible method, measures overhead only
+torch::jit::Module makeIdentity() {
+  torch::jit::Module module("Identity");
+  module.register_buffer("forward_params", methodParams(1, 1, 1, 1));
+  module.define(R"(
+    def forward(self, x):
+        return x
+
+    def get_methods(self) -> List[str]:
+        return ["forward"]
+
+    def get_attributes(self) -> List[str]:
+        return []
+  )");
+  return module;
+}
+
+// a RAVE-like autoencoder: strided convolution encoder, a stack of dilated
+// convolutions on latents, and a transposed convolution decoder.
+// Latents are computed every `ratio` samples, as in RAVE models.
+torch::jit::Module makeAutoencoder(int latentDim, int ratio, int hidden, int layers) {
+  torch::manual_seed(0);
+  torch::jit::Module module("Autoencoder");
+  module.register_parameter("enc_w", torch::randn({hidden, 1, ratio}) * 0.01, false);
+  module.register_parameter("enc_out_w", torch::randn({latentDim, hidden, 1}) * 0.1, false);
+  module.register_parameter("dec_in_w", torch::randn({hidden, latentDim, 1}) * 0.1, false);
+  module.register_parameter("hidden_w", torch::randn({layers, hidden, hidden, 3}) * 0.01, false);
+  module.register_parameter("dec_w", torch::randn({hidden, 1, ratio}) * 0.01, false);
+  module.register_attribute("ratio", c10::IntType::get(), ratio);
+  module.register_attribute("layers", c10::IntType::get(), layers);
+  module.register_buffer("encode_params", methodParams(1, 1, latentDim, ratio));
+  module.register_buffer("decode_params", methodParams(latentDim, ratio, 1, 1));
+  module.register_buffer("forward_params", methodParams(1, 1, 1, 1));
+  module.define(R"(
+    def encode(self, x):
+        h = torch.conv1d(x, self.enc_w, stride=self.ratio)
+        return torch.conv1d(torch.tanh(h), self.enc_out_w)
+
+    def decode(self, z):
+        h = torch.conv1d(z, self.dec_in_w)
+        dilation = 1
+        for i in range(self.layers):
+            h = h + torch.conv1d(torch.tanh(h), self.hidden_w[i], padding=dilation, dilation=dilation)
+            dilation = dilation * 2
+        return torch.tanh(torch.conv_transpose1d(h, self.dec_w, stride=self.ratio))
+
+    def forward(self, x):
+        return self.decode(self.encode(x))
+
+    def get_methods(self) -> List[str]:
+        return ["forward", "encode", "decode"]
+
+    def get_attributes(self) -> List[str]:
+        return []
+  )");
+  return module;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <output directory>\n";
+    return 1;
+  }
+  std::filesystem::path dir(argv[1]);
+  try {
+    std::filesystem::create_directories(dir);
+    makeIdentity().save((dir / "identity.ts").string());
+    // sizes in the range of RAVE v2 models
+    makeAutoencoder(8, 2048, 64, 4).save((dir / "autoencoder.ts").string());
+    makeAutoencoder(16, 512, 128, 6).save((dir / "autoencoder_large.ts").string());
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
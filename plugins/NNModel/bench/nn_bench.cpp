@@ -0,0 +1,292 @@
+// nn_bench.cpp
+// measures Backend::perform outside of scsynth: sweeps methods, buffer sizes,
+// batches and intra-op threads, and reports real-time factor, latency
+// percentiles and heap allocations per call as JSON.
+//
+// usage: nn_bench <model.ts> [options]
+//   --methods a,b          methods to run (default: all)
+//   --buffer-sizes 512,..  buffer sizes (default: 512,1024,2048,4096)
+//   --batches 1,4          numbers of batches (default: 1)
+//   --threads 1,2          intra-op threads (default: 1)
+//   --iterations n         measured calls per configuration (default: 200)
+//   --warmup n             minimum unmeasured calls before measuring, until call
+//                          time is stable (default: 10)
+//   --samplerate sr        to compute the real-time factor (default: 48000)
+//   --precision p          fp32, bf16 or int8 (default: fp32)
+//   --optimize 0|1         freeze and optimize the model for inference (default: 0)
+//   --out file.json        write results to file instead of stdout
+
+#include "backend.h"
+#include <torch/torch.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// ALLOCATION COUNTING
+// counts heap allocations on any thread while enabled, including libtorch's
+// tensor allocations, which don't go through operator new
+
+static std::atomic<bool> gCountAllocations = false;
+static std::atomic<uint64_t> gAllocations = 0;
+
+static inline void countAllocation() {
+  if (gCountAllocations.load(std::memory_order_relaxed))
+    gAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+#include <cerrno>
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+  countAllocation();
+  return __libc_malloc(size);
+}
+void* calloc(size_t n, size_t size) {
+  countAllocation();
+  return __libc_calloc(n, size);
+}
+void* realloc(void* ptr, size_t size) {
+  countAllocation();
+  return __libc_realloc(ptr, size);
+}
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+  countAllocation();
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr ? 0 : ENOMEM;
+}
+void* aligned_alloc(size_t alignment, size_t size) {
+  countAllocation();
+  return __libc_memalign(alignment, size);
+}
+}
+#else
+// elsewhere only allocations through operator new are counted
+void* operator new(size_t size) {
+  countAllocation();
+  if (void* ptr = std::malloc(size)) return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+namespace {
+
+struct Options {
+  std::string modelPath;
+  std::vector<std::string> methods;
+  std::vector<int> bufferSizes{512, 1024, 2048, 4096};
+  std::vector<int> batches{1};
+  std::vector<int> threads{1};
+  int iterations = 200;
+  int warmup = 10;
+  double sampleRate = 48000;
+  Precision precision = Precision::fp32;
+  bool optimize = false;
+  std::string outFile;
+};
+
+struct Result {
+  std::string method;
+  int bufferSize, batches, threads;
+  double meanUs, p50Us, p99Us, maxUs;
+  // processing time over played time: below 1 keeps up with real time
+  double rtf;
+  double allocationsPerCall;
+  // unmeasured calls until call time was stable
+  int warmupPasses;
+};
+
+std::vector<std::string> split(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty()) items.push_back(item);
+  return items;
+}
+
+std::vector<int> splitInts(const std::string& list) {
+  std::vector<int> values;
+  for (const auto& item: split(list)) values.push_back(std::stoi(item));
+  return values;
+}
+
+bool parseArgs(int argc, char** argv, Options& options) {
+  if (argc < 2) return false;
+  options.modelPath = argv[1];
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) return false;
+    std::string value = argv[++i];
+    if (arg == "--methods") options.methods = split(value);
+    else if (arg == "--buffer-sizes") options.bufferSizes = splitInts(value);
+    else if (arg == "--batches") options.batches = splitInts(value);
+    else if (arg == "--threads") options.threads = splitInts(value);
+    else if (arg == "--iterations") options.iterations = std::max(1, std::stoi(value));
+    else if (arg == "--warmup") options.warmup = std::max(0, std::stoi(value));
+    else if (arg == "--samplerate") options.sampleRate = std::stod(value);
+    else if (arg == "--precision") {
+      if (value == "fp32") options.precision = Precision::fp32;
+      else if (value == "bf16") options.precision = Precision::bf16;
+      else if (value == "int8") options.precision = Precision::int8;
+      else return false;
+    }
+    else if (arg == "--optimize") options.optimize = std::stoi(value) != 0;
+    else if (arg == "--out") options.outFile = value;
+    else return false;
+  }
+  return true;
+}
+
+double quantile(const std::vector<double>& sorted, double q) {
+  auto idx = static_cast<size_t>(q * (sorted.size() - 1));
+  return sorted[idx];
+}
+
+bool run(Backend& backend, const Options& options, const std::string& method,
+         int bufferSize, int batches, int threads, Result& result) {
+  auto params = backend.get_method_params(method);
+  if (params.size() < 4) return false;
+  int inDim = params[0], outDim = params[2];
+  if (bufferSize % params[1] != 0 || bufferSize % params[3] != 0) return false;
+
+  at::set_num_threads(threads);
+  PreparedMethod prepared;
+  if (!backend.prepare(prepared, method, params, bufferSize, batches))
+    return false;
+
+  std::vector<float> in(inDim * batches * bufferSize);
+  std::vector<float> out(outDim * batches * bufferSize);
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> noise(-1.f, 1.f);
+  for (auto& x: in) x = noise(rng);
+
+  result.warmupPasses = backend.warmup(prepared, {}, options.warmup);
+
+  std::vector<double> times;
+  times.reserve(options.iterations);
+  gAllocations = 0;
+  gCountAllocations = true;
+  for (int i = 0; i < options.iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    backend.perform(prepared, in.data(), out.data());
+    auto end = std::chrono::steady_clock::now();
+    times.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  gCountAllocations = false;
+
+  std::sort(times.begin(), times.end());
+  double sum = 0;
+  for (auto t: times) sum += t;
+  result.method = method;
+  result.bufferSize = bufferSize;
+  result.batches = batches;
+  result.threads = threads;
+  result.meanUs = sum / times.size();
+  result.p50Us = quantile(times, 0.5);
+  result.p99Us = quantile(times, 0.99);
+  result.maxUs = times.back();
+  double playedUs = 1e6 * bufferSize / options.sampleRate;
+  result.rtf = result.meanUs / playedUs;
+  result.allocationsPerCall = static_cast<double>(gAllocations) / options.iterations;
+  return true;
+}
+
+const char* precisionName(Precision precision) {
+  switch (precision) {
+    case Precision::bf16: return "bf16";
+    case Precision::int8: return "int8";
+    default: return "fp32";
+  }
+}
+
+void writeJson(std::ostream& stream, const Options& options,
+               const std::vector<Result>& results) {
+  stream << "{\n  \"model\": \"" << options.modelPath << "\","
+    << "\n  \"sampleRate\": " << options.sampleRate << ","
+    << "\n  \"iterations\": " << options.iterations << ","
+    << "\n  \"precision\": \"" << precisionName(options.precision) << "\","
+    << "\n  \"optimize\": " << (options.optimize ? "true" : "false") << ","
+    << "\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    stream << (i ? "," : "") << "\n    {"
+      << "\"method\": \"" << r.method << "\", "
+      << "\"bufferSize\": " << r.bufferSize << ", "
+      << "\"batches\": " << r.batches << ", "
+      << "\"threads\": " << r.threads << ", "
+      << "\"meanUs\": " << r.meanUs << ", "
+      << "\"p50Us\": " << r.p50Us << ", "
+      << "\"p99Us\": " << r.p99Us << ", "
+      << "\"maxUs\": " << r.maxUs << ", "
+      << "\"rtf\": " << r.rtf << ", "
+      << "\"allocationsPerCall\": " << r.allocationsPerCall << ", "
+      << "\"warmupPasses\": " << r.warmupPasses << "}";
+  }
+  stream << "\n  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseArgs(argc, argv, options)) {
+    std::cerr << "usage: " << argv[0] << " <model.ts> [--methods a,b] [--buffer-sizes 512,1024]"
+      << " [--batches 1,4] [--threads 1,2] [--iterations n] [--warmup n]"
+      << " [--samplerate sr] [--precision fp32|bf16|int8] [--optimize 0|1]"
+      << " [--out file.json]\n";
+    return 1;
+  }
+
+  LoadOptions loadOptions;
+  loadOptions.precision = options.precision;
+  loadOptions.optimize = options.optimize;
+  Precision precision;
+  auto module = Backend::load_module(options.modelPath, loadOptions, precision);
+  Backend backend;
+  if (backend.load(module, options.modelPath, precision) != 0) {
+    std::cerr << "can't load model " << options.modelPath << "\n";
+    return 1;
+  }
+  // report the precision actually used
+  options.precision = precision;
+  if (options.methods.empty()) options.methods = backend.get_available_methods();
+
+  std::vector<Result> results;
+  for (const auto& method: options.methods)
+    for (int bufferSize: options.bufferSizes)
+      for (int batches: options.batches)
+        for (int threads: options.threads) {
+          Result result;
+          if (run(backend, options, method, bufferSize, batches, threads, result))
+            results.push_back(result);
+          else
+            std::cerr << "skipping " << method << " bufferSize " << bufferSize
+              << " batches " << batches << "\n";
+        }
+
+  if (options.outFile.empty()) {
+    writeJson(std::cout, options, results);
+  } else {
+    std::ofstream file(options.outFile);
+    if (!file.is_open()) {
+      std::cerr << "can't open " << options.outFile << "\n";
+      return 1;
+    }
+    writeJson(file, options, results);
+  }
+  return 0;
+}
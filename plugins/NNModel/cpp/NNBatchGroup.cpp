@@ -0,0 +1,217 @@
+#include "NNBatchGroup.hpp"
+#include "NNModelPool.hpp"
+#include "NNUGens.hpp"
+#include "SC_InterfaceTable.h"
+#include <algorithm>
+#include <limits>
+
+extern InterfaceTable* ft;
+extern NN::NNModelPool gModelPool;
+extern NN::NNBatchScheduler gBatchScheduler;
+extern NN::NNWorkerPool gWorkerPool;
+
+namespace NN {
+
+NNBatchGroup::NNBatchGroup(const NNModelDesc* modelDesc, const NNModelMethod* method,
+                           int bufferSize, int capacity, double gatherTimeout,
+                           int warmup, int debug):
+  m_modelDesc(modelDesc), m_method(method),
+  m_bufferSize(bufferSize), m_capacity(capacity),
+  m_inDim(method->inDim), m_outDim(method->outDim),
+  m_warmup(warmup), m_debug(debug),
+  m_gatherTimeout(std::chrono::duration_cast<Clock::duration>(
+    std::chrono::duration<double>(gatherTimeout))),
+  m_loaded(false), m_closed(false),
+  m_signaled(false), m_deadline(Clock::time_point::max().time_since_epoch().count()),
+  m_priority(0), m_stopping(0),
+  m_lanes(capacity, nullptr),
+  m_inModel(capacity * method->inDim * (bufferSize / method->inRatio), 0.f),
+  m_outModel(capacity * method->outDim * (bufferSize / method->outRatio), 0.f)
+{
+  m_members.reserve(capacity);
+  m_snapshot.reserve(capacity);
+  m_included.reserve(capacity);
+}
+
+bool NNBatchGroup::join(NN* member) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_closed) return false;
+  // find enough contiguous free lanes
+  int batches = member->m_batches;
+  for (int lane = 0; lane + batches <= m_capacity; ++lane) {
+    auto first = m_lanes.begin() + lane;
+    if (std::any_of(first, first + batches, [](NN* nn) { return nn != nullptr; }))
+      continue;
+    std::fill(first, first + batches, member);
+    m_members.push_back({member, lane});
+    // before loaded: the member submits its windows to the group
+    member->m_batchGroup.store(this, std::memory_order_release);
+    member->m_loaded = m_loaded;
+    return true;
+  }
+  return false;
+}
+
+void NNBatchGroup::wake(Clock::time_point deadline) {
+  // keep the earliest deadline among members
+  auto rep = deadline.time_since_epoch().count();
+  auto current = m_deadline.load(std::memory_order_relaxed);
+  while (rep < current && !m_deadline.compare_exchange_weak(current, rep, std::memory_order_relaxed)) {}
+  m_signaled.store(true, std::memory_order_release);
+  m_submitted.notify();
+  gWorkerPool.notify(this);
+}
+
+void NNBatchGroup::stop(NN* member) {
+  // the group can't be done before member is freed, nor free it before it's stopped
+  int worker = this->worker();
+  m_stopping.fetch_add(1, std::memory_order_release);
+  member->m_should_stop_perform_thread = true;
+  gWorkerPool.notifyWorker(worker);
+}
+
+void NNBatchGroup::load() {
+  auto path = m_modelDesc->getPath();
+  if (m_debug >= Debug::all)
+    Print("NNBatchGroup: loading model %s (%d batches)\n", path, m_capacity);
+  if (!gModelPool.load(m_modelDesc, m_model)) {
+    Print("NNBatchGroup: ERROR loading model %s\n", path);
+    return;
+  }
+  if (!m_model.prepare(m_prepared, m_method->name,
+                       {m_inDim, m_method->inRatio, m_outDim, m_method->outRatio},
+                       m_bufferSize, m_capacity, true)) {
+    Print("NNBatchGroup: ERROR preparing method %s\n", m_method->name.c_str());
+    return;
+  }
+  int passes = m_model.warmup(m_prepared, getJitSettings(m_modelDesc), m_warmup);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_loaded = true;
+  for (auto& [member, lane]: m_members) member->m_loaded = true;
+  if (m_debug >= Debug::all)
+    Print("NNBatchGroup: loaded %s, warmed up in %d passes\n", path, passes);
+}
+
+void NNBatchGroup::takeSnapshot() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_snapshot = m_members;
+  // run with the priority of the most important member
+  int priority = m_members.empty() ? 0 : std::numeric_limits<int>::min();
+  for (auto& [member, lane]: m_members)
+    priority = std::max(priority, member->m_priority.load(std::memory_order_relaxed));
+  m_priority.store(priority, std::memory_order_relaxed);
+}
+
+bool NNBatchGroup::allPending() const {
+  return std::all_of(m_snapshot.begin(), m_snapshot.end(), [](const auto& m) {
+    return m.first->m_queue.hasPending();
+  });
+}
+
+// windows hold model rate frames, see PreparedMethod::decimated
+bool NNBatchGroup::perform() {
+  size_t inFrames = m_prepared.in_frames();
+  size_t outFrames = m_prepared.out_frames();
+  // free lanes and members that didn't submit in time process silence
+  std::fill(m_inModel.begin(), m_inModel.end(), 0.f);
+  m_included.clear();
+  for (auto& [member, lane]: m_snapshot) {
+    if (!member->m_queue.hasPending()) continue;
+    // inputs are interlaced by dimension (d * batches + b):
+    // copy each dimension's batches to the member's lanes
+    member->readBuffer(member->m_queue.pendingInput());
+    const float* inModel = member->m_queue.pendingInput();
+    size_t batches = member->m_batches;
+    for (int d = 0; d < m_inDim; ++d)
+      std::copy_n(&inModel[d * batches * inFrames], batches * inFrames,
+                  &m_inModel[(d * m_capacity + lane) * inFrames]);
+    m_included.push_back({member, lane});
+  }
+  if (m_included.empty()) return false;
+
+  auto start = Clock::now();
+  m_model.perform(m_prepared, m_inModel.data(), m_outModel.data());
+  auto done = Clock::now();
+
+  // outputs are grouped by batch (b * outDim + d): copy members' lanes at once
+  for (auto& [member, lane]: m_included) {
+    size_t size = member->m_batches * m_outDim * outFrames;
+    std::copy_n(&m_outModel[lane * m_outDim * outFrames], size,
+                member->m_queue.pendingOutput());
+    member->writeBuffer(member->m_queue.pendingOutput());
+    auto& stats = member->m_stats;
+    stats.record(m_prepared.timings);
+    stats.record(stageCompute, done - start);
+    stats.count(countWindows);
+    if (done > member->m_queue.pendingDeadline()) stats.count(countMissed);
+    member->m_queue.complete();
+  }
+  return true;
+}
+
+bool NNBatchGroup::freeStopped() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::erase_if(m_members, [this](const auto& m) {
+    NN* member = m.first;
+    if (!member->m_should_stop_perform_thread) return false;
+    std::replace(m_lanes.begin(), m_lanes.end(), member, static_cast<NN*>(nullptr));
+    model_perform_cleanup(member);
+    m_stopping.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  });
+  return m_members.empty();
+}
+
+bool NNBatchGroup::run() {
+  m_signaled.store(false, std::memory_order_relaxed);
+  m_deadline.store(Clock::time_point::max().time_since_epoch().count(), std::memory_order_relaxed);
+  takeSnapshot();
+  // aligned members submit on the same audio block: wait for the others,
+  // sleeping until a member submits
+  auto gatherEnd = Clock::now() + m_gatherTimeout;
+  while (true) {
+    auto epoch = m_submitted.epoch();
+    if (allPending() || !m_submitted.waitUntil(epoch, gatherEnd)) break;
+  }
+  // late members can have more than one window queued: catch up
+  if (m_loaded) while (perform()) {}
+  if (freeStopped() && gBatchScheduler.remove(this)) {
+    if (m_debug >= Debug::all)
+      Print("NNBatchGroup: done\n");
+    return false;
+  }
+  return true;
+}
+
+NNBatchGroup* NNBatchScheduler::join(NN* member, int capacity,
+                                     double gatherTimeout, int warmup) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Key key{member->m_modelDesc, member->m_method, member->m_bufferSize};
+  auto [first, last] = m_groups.equal_range(key);
+  for (auto it = first; it != last; ++it) {
+    if (it->second->join(member)) return it->second;
+  }
+
+  capacity = std::max(capacity, member->m_batches);
+  auto group = new NNBatchGroup(member->m_modelDesc, member->m_method,
+                                member->m_bufferSize, capacity, gatherTimeout,
+                                warmup, member->m_debug);
+  group->join(member);
+  m_groups.insert({key, group});
+  gWorkerPool.add(group);
+  return group;
+}
+
+bool NNBatchScheduler::remove(NNBatchGroup* group) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::lock_guard<std::mutex> groupLock(group->m_mutex);
+  if (!group->m_members.empty()) return false;
+  group->m_closed = true;
+  auto it = std::find_if(m_groups.begin(), m_groups.end(),
+                         [group](const auto& kv) { return kv.second == group; });
+  if (it != m_groups.end()) m_groups.erase(it);
+  return true;
+}
+
+} // namespace NN
@@ -0,0 +1,120 @@
+// NNBatchGroup.hpp
+
+#pragma once
+#include "NNModel.hpp"
+#include "NNWorkerPool.hpp"
+#include "backend/backend.h"
+#include "rt_slot_queue.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace NN {
+
+class NN;
+
+// runs a single batched inference for all NNUGens playing the same model
+// method with the same buffer size.
+// Each member gets fixed lanes (batches) in the group's model instance, so that
+// model state (e.g. streaming buffers) is kept separate for each member.
+// Free lanes and members that didn't submit in time process silence: a lane
+// freed by a member has decayed to the state silence leaves by the time
+// another member joins, as long as the method's memory is shorter than that.
+// Members align their windows to the server clock, so that they submit them on
+// the same audio block, and the group only waits for them for a short time.
+// Groups are run on the worker pool, by their members' earliest deadline.
+class NNBatchGroup : public NNComputeJob {
+public:
+  NNBatchGroup(const NNModelDesc* modelDesc, const NNModelMethod* method,
+               int bufferSize, int capacity, double gatherTimeout,
+               int warmup, int debug);
+
+  // schedule group: a member submitted a window due by deadline
+  void wake(Clock::time_point deadline);
+  // stop member, on the NRT thread. The group can free member and itself as
+  // soon as it's stopped: neither is touched afterwards
+  void stop(NN* member);
+
+  int capacity() const { return m_capacity; }
+
+  // NNComputeJob
+  void load() override;
+  bool ready() const override {
+    return m_signaled.load(std::memory_order_acquire)
+      || m_stopping.load(std::memory_order_acquire) > 0;
+  }
+  Clock::time_point deadline() const override {
+    return Clock::time_point(Clock::duration(m_deadline.load(std::memory_order_relaxed)));
+  }
+  int priority() const override { return m_priority.load(std::memory_order_relaxed); }
+  int intraOpThreads() const override { return m_modelDesc->getIntraOpThreads(); }
+  bool run() override;
+  void retire() override { delete this; }
+
+private:
+  friend class NNBatchScheduler;
+
+  // assign lanes to member, false if there's not enough room
+  bool join(NN* member);
+  void takeSnapshot();
+  bool allPending() const;
+  // process the oldest pending window of each member, false if none
+  bool perform();
+  // free members that were stopped, returns true if no member is left
+  bool freeStopped();
+
+  const NNModelDesc* m_modelDesc;
+  const NNModelMethod* m_method;
+  int m_bufferSize, m_capacity;
+  int m_inDim, m_outDim;
+  int m_warmup, m_debug;
+  Clock::duration m_gatherTimeout;
+
+  Backend m_model;
+  PreparedMethod m_prepared;
+  bool m_loaded;
+  bool m_closed;
+
+  // set by members, reset when the group runs
+  std::atomic<bool> m_signaled;
+  std::atomic<Clock::rep> m_deadline;
+  std::atomic<int> m_priority;
+  // members being stopped, not freed yet: keeps the group ready
+  std::atomic<int> m_stopping;
+  // notified when a member submits, while gathering windows
+  HybridEvent m_submitted;
+
+  std::mutex m_mutex;
+  // (member, first lane)
+  std::vector<std::pair<NN*, int>> m_members;
+  std::vector<std::pair<NN*, int>> m_snapshot;
+  std::vector<NN*> m_lanes;
+  // (member, first lane) of members processed in the current call
+  std::vector<std::pair<NN*, int>> m_included;
+
+  // batched model buffers, gathered from and scattered to members
+  std::vector<float> m_inModel, m_outModel;
+};
+
+// registry of batch groups, by model, method and buffer size
+class NNBatchScheduler {
+public:
+  // add member to a group with enough free lanes, creating one if needed.
+  // Locks and allocates: on the NRT thread, see model_perform_register
+  NNBatchGroup* join(NN* member, int capacity, double gatherTimeout, int warmup);
+
+private:
+  friend class NNBatchGroup;
+  // called by a group with no members left: false if someone joined meanwhile
+  bool remove(NNBatchGroup* group);
+
+  using Key = std::tuple<const NNModelDesc*, const NNModelMethod*, int>;
+  std::mutex m_mutex;
+  std::multimap<Key, NNBatchGroup*> m_groups;
+};
+
+} // namespace NN
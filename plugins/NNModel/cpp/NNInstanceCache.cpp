@@ -0,0 +1,151 @@
+#include "NNInstanceCache.hpp"
+#include "NNModelPool.hpp"
+#include "SC_InterfaceTable.h"
+#include <algorithm>
+
+extern InterfaceTable* ft;
+extern NN::NNModelPool gModelPool;
+
+namespace NN {
+
+// instances are given back from NRT and worker threads, under the lock:
+// room for this many waiting to be reset is reserved upfront
+static constexpr size_t maxReturned = 256;
+
+NNInstanceCache::~NNInstanceCache() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+    m_cond.notify_all();
+  }
+  if (m_thread.joinable()) m_thread.join();
+  for (auto instance: m_returned) delete instance;
+  for (auto& [key, slot]: m_slots)
+    for (auto instance: slot.ready) delete instance;
+}
+
+void NNInstanceCache::start() {
+  m_returned.reserve(maxReturned);
+  m_thread = std::thread(&NNInstanceCache::loop, this);
+}
+
+bool NNInstanceCache::prepare(NNModelInstance* instance) {
+  auto [model, method, bufferSize, batches] = instance->key;
+  if (!instance->model.prepare(instance->prepared, method->name,
+                               {method->inDim, method->inRatio, method->outDim, method->outRatio},
+                               bufferSize, batches, true)) {
+    Print("NNInstanceCache: ERROR preparing method %s\n", method->name.c_str());
+    return false;
+  }
+  // resolve all setters now: UGens pick theirs by attribute index
+  instance->setters.resize(model->numAttributes());
+  for (size_t i = 0; i < instance->setters.size(); ++i) {
+    auto attr = model->getAttribute(static_cast<unsigned short>(i), false);
+    if (attr->type != NNAttributeType::typeOther)
+      instance->model.prepare_setter(instance->setters[i], attr->name);
+  }
+  return true;
+}
+
+// run the prepared method on silence, with the instance's real shape:
+// libtorch allocates and the JIT profiles and optimizes on first calls
+int NNInstanceCache::warmup(NNModelInstance* instance, int n_passes) {
+  auto model = std::get<0>(instance->key);
+  return instance->model.warmup(instance->prepared, getJitSettings(model), n_passes);
+}
+
+NNModelInstance* NNInstanceCache::create(const Key& key, int n_passes) {
+  std::call_once(m_started, &NNInstanceCache::start, this);
+  auto instance = new NNModelInstance();
+  instance->key = key;
+  if (!gModelPool.load(std::get<0>(key), instance->model) || !prepare(instance)) {
+    delete instance;
+    return nullptr;
+  }
+  instance->warmupPasses = warmup(instance, n_passes);
+  return instance;
+}
+
+int NNInstanceCache::warmup(const Key& key, int count, int n_passes) {
+  std::vector<NNModelInstance*> extra;
+  int missing;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& slot = m_slots[key];
+    slot.target = std::max(0, count);
+    while (slot.ready.size() > static_cast<size_t>(slot.target)) {
+      extra.push_back(slot.ready.back());
+      slot.ready.pop_back();
+    }
+    missing = slot.target - static_cast<int>(slot.ready.size());
+  }
+  for (auto instance: extra) delete instance;
+  // load outside of the lock: UGens can keep adopting instances meanwhile
+  int passes = 0;
+  for (int i = 0; i < missing; ++i) {
+    auto instance = create(key, n_passes);
+    if (instance == nullptr) break;
+    passes = instance->warmupPasses;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_slots[key].ready.push_back(instance);
+  }
+  return passes;
+}
+
+NNModelInstance* NNInstanceCache::take(const Key& key) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_slots.find(key);
+  if (it == m_slots.end() || it->second.ready.empty()) return nullptr;
+  auto instance = it->second.ready.back();
+  it->second.ready.pop_back();
+  return instance;
+}
+
+void NNInstanceCache::give(NNModelInstance* instance) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_returned.push_back(instance);
+  m_cond.notify_one();
+}
+
+void NNInstanceCache::clear(const NNModelDesc* model) {
+  std::vector<NNModelInstance*> removed;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::erase_if(m_slots, [&](auto& kv) {
+      if (std::get<0>(kv.first) != model) return false;
+      removed.insert(removed.end(), kv.second.ready.begin(), kv.second.ready.end());
+      return true;
+    });
+  }
+  for (auto instance: removed) delete instance;
+}
+
+// reset returned instances and park them, or destroy them if not needed
+void NNInstanceCache::loop() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_cond.wait(lock, [this] { return m_stop || !m_returned.empty(); });
+    if (m_stop) return;
+    auto instance = m_returned.back();
+    m_returned.pop_back();
+    auto wanted = [&] {
+      auto it = m_slots.find(instance->key);
+      return it != m_slots.end() && it->second.ready.size() < static_cast<size_t>(it->second.target);
+    };
+    bool keep = wanted();
+    lock.unlock();
+    // a fresh context drops streaming state, methods are bound to it again
+    keep = keep && instance->model.reset_state() == 0 && prepare(instance);
+    if (keep) warmup(instance, 1);
+    lock.lock();
+    if (keep && wanted()) {
+      m_slots[instance->key].ready.push_back(instance);
+    } else {
+      lock.unlock();
+      delete instance;
+      lock.lock();
+    }
+  }
+}
+
+} // namespace NN
@@ -0,0 +1,80 @@
+// NNInstanceCache.hpp
+
+#pragma once
+#include "NNModel.hpp"
+#include "backend/backend.h"
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace NN {
+
+// an execution context of a model with a method prepared for a buffer size
+// and number of batches, ready to perform on model rate frames
+// (see PreparedMethod::decimated)
+struct NNModelInstance {
+  // model, method, bufferSize, batches
+  using Key = std::tuple<const NNModelDesc*, const NNModelMethod*, int, int>;
+
+  Key key;
+  Backend model;
+  PreparedMethod prepared;
+  // by attribute index of the model, unresolved for attributes without setter
+  std::vector<PreparedSetter> setters;
+  // passes its first warmup took until call time was stable
+  int warmupPasses = 0;
+};
+
+// warmed model instances, parked until a UGen with matching parameters
+// adopts one, and returned to the cache when that UGen is freed.
+// Loading, warming and resetting instances never happen on the audio thread:
+// commands create them on the NRT thread, returned ones are reset on the
+// cache's own thread
+class NNInstanceCache {
+public:
+  using Key = NNModelInstance::Key;
+
+  ~NNInstanceCache();
+
+  // load and prepare a new instance, warmed up with at least n_passes zero
+  // windows, until its call time is stable.
+  // Returns nullptr if the model or method can't be loaded
+  NNModelInstance* create(const Key& key, int n_passes);
+  // keep count warmed instances ready for key, creating them now.
+  // Returns the last created instance's warmup passes, 0 if none was created
+  int warmup(const Key& key, int count, int n_passes);
+  // a ready instance for key, or nullptr if there's none.
+  // Locks: UGens take instances on the NRT thread, see model_perform_register
+  NNModelInstance* take(const Key& key);
+  // give back an instance that was taken or created: reset and parked, or
+  // destroyed if enough are ready, in the background. Locks and allocates:
+  // called when processing stops, on a computation or the NRT thread
+  void give(NNModelInstance* instance);
+  // destroy all ready instances of model, and stop keeping them ready
+  void clear(const NNModelDesc* model);
+
+private:
+  struct Slot {
+    std::vector<NNModelInstance*> ready;
+    int target = 0;
+  };
+
+  static bool prepare(NNModelInstance* instance);
+  static int warmup(NNModelInstance* instance, int n_passes);
+  void start();
+  void loop();
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::map<Key, Slot> m_slots;
+  // returned instances, waiting to be reset
+  std::vector<NNModelInstance*> m_returned;
+  std::once_flag m_started;
+  std::thread m_thread;
+  bool m_stop = false;
+};
+
+} // namespace NN
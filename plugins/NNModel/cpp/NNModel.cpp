@@ -1,19 +1,82 @@
 #include "NNModel.hpp"
 #include "backend/backend.h"
 #include <algorithm>
+#include <bit>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <ostream>
+#include <sstream>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 #include "SC_InterfaceTable.h"
 
 extern InterfaceTable* ft;
 
 namespace NN {
 
+namespace fs = std::filesystem;
+
+// bump when the cache format changes
+static constexpr int cacheVersion = 1;
+
+// one file per model path, in cacheDir
+static std::string getCacheFile(const std::string& cacheDir, const char* path) {
+  std::stringstream name;
+  name << std::hex << std::hash<std::string>{}(path) << ".info";
+  return (fs::path(cacheDir) / name.str()).string();
+}
+
+static int processId() {
+#if defined(_WIN32)
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+static std::string getDefaultCacheDir() {
+#if defined(_WIN32)
+  const char* base = std::getenv("LOCALAPPDATA");
+  return base ? (fs::path(base) / "nn.ar").string() : "";
+#else
+  if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+    return (fs::path(xdg) / "nn.ar").string();
+  const char* home = std::getenv("HOME");
+  if (home == nullptr) return "";
+#if defined(__APPLE__)
+  return (fs::path(home) / "Library" / "Caches" / "nn.ar").string();
+#else
+  return (fs::path(home) / ".cache" / "nn.ar").string();
+#endif
+#endif
+}
+
 NNModelDesc::NNModelDesc(unsigned short id): m_idx(id) {}
 
-bool NNModelDesc::load(const char* path) {
+bool NNModelDesc::load(const char* path, const std::string& cacheDir) {
+  std::string cacheFile;
+  uintmax_t size = 0;
+  int64_t mtime = 0;
+  if (!cacheDir.empty()) {
+    std::error_code ec;
+    size = fs::file_size(path, ec);
+    if (!ec) mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    if (!ec) cacheFile = getCacheFile(cacheDir, path);
+  }
+  if (!cacheFile.empty() && readCache(cacheFile, path, size, mtime)) {
+    Print("NNModelDesc: loaded %s (cached info)\n", path);
+    m_path = path;
+    m_loaded = true;
+    return true;
+  }
+
   Print("NNModelDesc: loading %s\n", path);
   Backend backend;
   bool loaded = backend.load(path) == 0;
@@ -56,9 +119,93 @@ bool NNModelDesc::load(const char* path) {
   }
 
   m_loaded = true;
+  if (!cacheFile.empty()) writeCache(cacheFile, size, mtime);
   return true;
 }
 
+// cache file: a header line, the file stamp, then one line per item
+//   nn.ar-info <version>
+//   <size> <mtime> <higherRatio>
+//   method <name> <inDim> <inRatio> <outDim> <outRatio>
+//   attribute <type> <name>
+//   path <path>
+bool NNModelDesc::readCache(const std::string& cacheFile, const char* path, uintmax_t size, int64_t mtime) {
+  std::ifstream file(cacheFile);
+  if (!file.is_open()) return false;
+  std::string magic;
+  int version;
+  uintmax_t cachedSize;
+  int64_t cachedMtime;
+  int higherRatio;
+  if (!(file >> magic >> version >> cachedSize >> cachedMtime >> higherRatio)
+      || magic != "nn.ar-info" || version != cacheVersion
+      || cachedSize != size || cachedMtime != mtime)
+    return false;
+  std::vector<NNModelMethod> methods;
+  std::vector<NNModelAttribute> attributes;
+  std::string cachedPath, kind;
+  while (file >> kind) {
+    if (kind == "method") {
+      std::string name;
+      std::vector<int> params(4);
+      if (!(file >> name >> params[0] >> params[1] >> params[2] >> params[3])) return false;
+      methods.push_back({name, params});
+    } else if (kind == "attribute") {
+      int type;
+      std::string name;
+      if (!(file >> type >> name)) return false;
+      attributes.push_back({static_cast<NNAttributeType>(type), name});
+    } else if (kind == "path") {
+      file >> std::ws;
+      std::getline(file, cachedPath);
+    } else {
+      return false;
+    }
+  }
+  // hash collision: another model's info
+  if (cachedPath != path) return false;
+  m_higherRatio = higherRatio;
+  m_methods = std::move(methods);
+  m_attributes = std::move(attributes);
+  return true;
+}
+
+void NNModelDesc::writeCache(const std::string& cacheFile, uintmax_t size, int64_t mtime) const {
+  std::error_code ec;
+  fs::create_directories(fs::path(cacheFile).parent_path(), ec);
+  // write aside and rename: concurrent servers never read a partial file,
+  // nor write to the same one
+  auto tmpFile = cacheFile + ".tmp" + std::to_string(processId());
+  {
+    std::ofstream file(tmpFile);
+    if (!file.is_open()) {
+      Print("NNModelDesc: can't write info cache %s\n", cacheFile.c_str());
+      return;
+    }
+    file << "nn.ar-info " << cacheVersion
+      << "\n" << size << " " << mtime << " " << m_higherRatio;
+    for (const auto& m: m_methods)
+      file << "\nmethod " << m.name << " " << m.inDim << " " << m.inRatio
+        << " " << m.outDim << " " << m.outRatio;
+    for (const auto& attr: m_attributes)
+      file << "\nattribute " << attr.type << " " << attr.name;
+    file << "\npath " << m_path << "\n";
+  }
+  fs::rename(tmpFile, cacheFile, ec);
+  if (ec) fs::remove(tmpFile, ec);
+}
+
+void NNModelDesc::setOverloadPolicy(int policy, int missThreshold, float shedTime) {
+  m_overloadPolicy = policy;
+  m_missThreshold = std::max(1, missThreshold);
+  m_shedTime = std::max(0.f, shedTime);
+}
+
+int NNModelDesc::getBufferSize(int requested) const {
+  if (requested < m_higherRatio) return m_higherRatio;
+  return static_cast<int>(std::bit_ceil(static_cast<unsigned>(requested)));
+}
+
 const NNModelMethod* NNModelDesc::getMethod(unsigned short idx, bool warn) const {
   try {
     return &m_methods.at(idx);
@@ -85,7 +232,7 @@ name(name) {
   outRatio = params[3];
 }
 
-NNModelDescLib::NNModelDescLib(): models(), modelCount(0) {}
+NNModelDescLib::NNModelDescLib(): models(), modelCount(0), m_cacheDir(getDefaultCacheDir()) {}
 
 unsigned short NNModelDescLib::getNextId() {
   unsigned short id = modelCount;
@@ -97,7 +244,7 @@ NNModelDesc* NNModelDescLib::get(unsigned short id, bool warn) const {
   NNModelDesc* model;
   bool found = false;
   try {
-    model = models.at(id);
+    model = models.at(id).get();
     found = model != nullptr;
   } catch(...) {
     if (warn) {
@@ -116,6 +263,11 @@ NNModelDesc* NNModelDescLib::get(unsigned short id, bool warn) const {
   return model;
 }
 
+std::shared_ptr<const NNModelDesc> NNModelDescLib::pin(unsigned short id) const {
+  auto it = models.find(id);
+  return it == models.end() ? nullptr : it->second;
+}
+
 void NNModelDescLib::streamAllInfo(std::ostream& dest) const{
   for (const auto& kv: models) {
     kv.second->streamInfo(dest);
@@ -153,28 +305,25 @@ NNModelDesc* NNModelDescLib::load(unsigned short id, const char* path) {
     if (strcmp(model->getPath(), path) == 0) {
       Print("NNBackend: model %d already loaded %s\n", id, path);
       return model;
-    } else {
-      return model->load(path) ? model : nullptr;
+    } else if (models[id].use_count() == 1) {
+      return model->load(path, m_cacheDir) ? model : nullptr;
     }
+    // pinned: replaced, the previous one is deleted once unpinned
   }
 
-  model = new NNModelDesc(id);
-  if (model->load(path)) {
-    models[id] = model;
-    modelCount++;
-    return model;
-  } else {
-    delete model;
-    return nullptr;
-  }
+  auto loaded = std::make_shared<NNModelDesc>(id);
+  if (!loaded->load(path, m_cacheDir)) return nullptr;
+  if (model == nullptr) modelCount++;
+  models[id] = loaded;
+  return loaded.get();
 }
 
 void NNModelDescLib::unload(unsigned short id) {
   auto model = get(id, true);
   if (model == nullptr) return;
   /* Print("NNBackend: unloading model %s at idx %d\n", model->m_path, id); */
+  // deleted now, or once unpinned
   models.erase(id);
-  delete model;
 }
 
 bool NNModelDescLib::dumpAllInfo(const char* filename) const {
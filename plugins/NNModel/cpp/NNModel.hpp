@@ -1,9 +1,13 @@
 // NNModel.hpp
 
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <ostream>
+#include <string>
 #include <vector>
 #include <map>
+#include <memory>
 
 namespace NN {
 
@@ -23,6 +27,18 @@ struct NNModelAttribute {
   std::string name;
 };
 
+// what NNUGens do when processing can't keep up with real time,
+// flags can be combined
+enum NNOverloadPolicy {
+  overloadNone = 0,
+  // fade out a repetition of the last window, instead of dropping to silence
+  overloadHold = 1,
+  // stop processing the lowest priority instance of the model for a while
+  overloadShed = 2,
+  // don't start new instances while the model is overloaded
+  overloadRefuse = 4
+};
+
 // read and store model information
 // needed mostly to avoid passing strings to UGens
 class NNModelDesc {
@@ -30,11 +46,13 @@ public:
 
   NNModelDesc(unsigned short id);
 
-  // load .ts, just to read info
-  bool load(const char* path);
+  // load .ts, just to read info.
+  // If cacheDir is set, info is read from there when the file didn't change
+  bool load(const char* path, const std::string& cacheDir = "");
   
   const NNModelMethod* getMethod(unsigned short idx, bool warn=true) const;
   const NNModelAttribute* getAttribute(unsigned short idx, bool warn=true) const;
+  size_t numAttributes() const { return m_attributes.size(); }
 
   // info
   bool is_loaded() const { return m_loaded; }
@@ -42,16 +60,60 @@ public:
   bool dumpInfo(const char* filename) const;
   void printInfo() const;
   int getHigherRatio() const { return m_higherRatio; }
+  // buffer size NNUGens use when asked for requested (<= 0: smallest possible)
+  int getBufferSize(int requested) const;
   const char* getPath() const { return m_path.c_str(); }
+  unsigned short getId() const { return m_idx; }
+
+  // overload policy: set by a command, read by UGens on the audio thread
+  void setOverloadPolicy(int policy, int missThreshold, float shedTime);
+  int getOverloadPolicy() const { return m_overloadPolicy.load(std::memory_order_relaxed); }
+  // consecutive late windows before an instance is considered overloaded
+  int getMissThreshold() const { return m_missThreshold.load(std::memory_order_relaxed); }
+  // seconds a shed instance stays silent before trying again
+  float getShedTime() const { return m_shedTime.load(std::memory_order_relaxed); }
+
+  // libtorch intra-op threads used by this model's compute jobs, 0: pool default
+  void setIntraOpThreads(int n) { m_intraOpThreads = n; }
+  int getIntraOpThreads() const { return m_intraOpThreads.load(std::memory_order_relaxed); }
+
+  // precision UGens run this model in (see Precision in backend.h)
+  void setPrecision(int precision) { m_precision = precision; }
+  int getPrecision() const { return m_precision.load(std::memory_order_relaxed); }
+  // UGens run a frozen copy of this model, optimized for inference
+  void setOptimize(bool optimize) { m_optimize = optimize; }
+  bool getOptimize() const { return m_optimize.load(std::memory_order_relaxed); }
+
+  // TorchScript executor settings used when warming up this model's methods
+  // (see JitSettings in backend.h), -1: libtorch default
+  void setJit(int profiling, int fusion, int bailoutDepth) {
+    m_jitProfiling = profiling; m_jitFusion = fusion; m_jitBailoutDepth = bailoutDepth;
+  }
+  int getJitProfiling() const { return m_jitProfiling.load(std::memory_order_relaxed); }
+  int getJitFusion() const { return m_jitFusion.load(std::memory_order_relaxed); }
+  int getJitBailoutDepth() const { return m_jitBailoutDepth.load(std::memory_order_relaxed); }
 
 
 private:
+  // on-disk info cache, valid while the model file's size and mtime don't change
+  bool readCache(const std::string& cacheFile, const char* path, uintmax_t size, int64_t mtime);
+  void writeCache(const std::string& cacheFile, uintmax_t size, int64_t mtime) const;
+
   std::vector<NNModelMethod> m_methods;
   std::vector<NNModelAttribute> m_attributes;
   int m_higherRatio;
   unsigned short m_idx;
   bool m_loaded = false;
   std::string m_path;
+  std::atomic<int> m_overloadPolicy = overloadNone;
+  std::atomic<int> m_missThreshold = 4;
+  std::atomic<float> m_shedTime = 2.f;
+  std::atomic<int> m_intraOpThreads = 0;
+  std::atomic<int> m_precision = 0;
+  std::atomic<bool> m_optimize = false;
+  std::atomic<int> m_jitProfiling = -1;
+  std::atomic<int> m_jitFusion = -1;
+  std::atomic<int> m_jitBailoutDepth = -1;
 };
 
 // register model info by int id
@@ -63,10 +125,16 @@ public:
   NNModelDesc* load(const char* path);
   NNModelDesc* load(unsigned short id, const char* path);
   void unload(unsigned short id);
+  // where model info is cached, empty to disable. Defaults to the user's cache directory
+  void setCacheDir(const char* dir) { m_cacheDir = dir; }
+  const std::string& getCacheDir() const { return m_cacheDir; }
   /* void reload(unsigned short id); */
 
   // get stored model
   NNModelDesc* get(unsigned short id, bool warn=true) const;
+  // keep a model's info alive while it's used off the NRT thread: unloading
+  // or loading another path to its id replaces it, deleted once unpinned
+  std::shared_ptr<const NNModelDesc> pin(unsigned short id) const;
   unsigned short findId(const char* path);
   // all loaded models info
   void streamAllInfo(std::ostream& stream) const;
@@ -75,8 +143,9 @@ public:
 
 private:
   unsigned short getNextId();
-  std::map<unsigned short, NNModelDesc*> models;
+  std::map<unsigned short, std::shared_ptr<NNModelDesc>> models;
   unsigned short modelCount;
+  std::string m_cacheDir;
 
 };
 
@@ -1,10 +1,31 @@
 #include "NNModelCmd.hpp"
 #include "NNModel.hpp"
+#include "NNInstanceCache.hpp"
+#include "NNModelPool.hpp"
+#include "NNStats.hpp"
+#include "NNWorkerPool.hpp"
+#include "backend/backend.h"
 #include "SC_InterfaceTable.h"
 #include "SC_PlugIn.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
 
 extern InterfaceTable* ft;
 extern NN::NNModelDescLib gModels;
+extern NN::NNModelPool gModelPool;
+extern NN::NNStatsRegistry gStats;
+extern NN::NNInstanceCache gInstanceCache;
+extern NN::NNWorkerPool gWorkerPool;
+extern std::atomic<float> gNrtWindow;
 
 inline char* copyStrToBuf(char** buf, const char* str) {
   char* res = strcpy(*buf, str); *buf += strlen(str) + 1;
@@ -13,23 +34,33 @@ inline char* copyStrToBuf(char** buf, const char* str) {
 
 namespace NN::Cmd {
 
-// /cmd /nn_set str str str
+// /cmd /nn_load int str str int
 struct LoadCmdData {
 public:
   int id;
   const char* path;
   const char* filename;
+  int intraOpThreads;
+  int precision;
+  int optimize;
 
   static LoadCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
 
     int id = args->geti(-1);
     const char* path = args->gets();
     const char* filename = args->gets("");
+    int intraOpThreads = args->geti(0);
+    int precision = args->geti(0);
+    int optimize = args->geti(0);
 
     if (path == 0) {
       Print("Error: nn_load needs a path to a .ts file\n");
       return nullptr;
     }
+    if (precision < 0 || precision > static_cast<int>(Precision::int8)) {
+      Print("Error: nn_load: unknown precision %d\n", precision);
+      return nullptr;
+    }
 
     size_t dataSize = sizeof(LoadCmdData)
       + strlen(path) + 1
@@ -45,6 +76,9 @@ public:
     cmdData->id = id;
     cmdData->path = copyStrToBuf(&data, path);
     cmdData->filename = copyStrToBuf(&data, filename);
+    cmdData->intraOpThreads = intraOpThreads;
+    cmdData->precision = precision;
+    cmdData->optimize = optimize;
     return cmdData;
   }
 
@@ -58,11 +92,25 @@ bool nn_load(World* world, void* inData) {
   const char* filename = data->filename;
 
   // Print("nn_load: idx %d path %s\n", id, path);
+  // loading another model or conversion to an id invalidates its warmed instances
+  if (auto previous = (id == -1) ? nullptr : gModels.get(static_cast<unsigned short>(id), false)) {
+    if (strcmp(previous->getPath(), path) != 0 || previous->getPrecision() != data->precision
+        || previous->getOptimize() != (data->optimize != 0))
+      gInstanceCache.clear(previous);
+  }
   auto model = (id == -1) ? gModels.load(path) : gModels.load(id, path);
 
   if (model != nullptr && strlen(filename) > 0) {
     model->dumpInfo(filename);
   }
+  if (model != nullptr) {
+    model->setIntraOpThreads(data->intraOpThreads);
+    model->setPrecision(data->precision);
+    model->setOptimize(data->optimize != 0);
+  }
+  // threads are created here rather than by the first UGen, on the audio thread.
+  // Send /nn_threads before loading to configure them
+  gWorkerPool.start();
   return true;
 }
 
@@ -107,6 +155,115 @@ bool nn_query(World* world, void* inData) {
 }
 
 
+// /cmd /nn_stats int str int
+struct StatsCmdData {
+public:
+  int modelIdx;
+  int reset;
+  const char* outFile;
+
+  static StatsCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    int modelIdx = args->geti(-1);
+    const char* outFile = args->gets("");
+    int reset = args->geti(0);
+
+    auto dataSize = sizeof(StatsCmdData) + strlen(outFile) + 1;
+    StatsCmdData* cmdData = (StatsCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_stats: alloc failed.\n"); return nullptr; }
+    cmdData->modelIdx = modelIdx;
+    cmdData->reset = reset;
+    char* data = (char*) (cmdData + 1);
+    cmdData->outFile = copyStrToBuf(&data, outFile);
+
+    return cmdData;
+  }
+
+  StatsCmdData() = delete;
+};
+
+bool nn_stats(World* world, void* inData) {
+  StatsCmdData* data = (StatsCmdData*)inData;
+  const char* outFile = data->outFile;
+  if (strlen(outFile) > 0)
+    gStats.dumpInfo(outFile, data->modelIdx);
+  else
+    gStats.printInfo(data->modelIdx);
+  if (data->reset) gStats.reset(data->modelIdx);
+  return true;
+}
+
+
+// /cmd /nn_threads int str int int int int int
+struct ThreadsCmdData {
+public:
+  int numWorkers;
+  const char* cpus;
+  int policy;
+  int priority;
+  int intraOpThreads;
+  int interOpThreads;
+  int lockMemory;
+
+  // "0-3,6": cores 0, 1, 2, 3 and 6
+  static std::vector<int> parseCpus(const char* cpus) {
+    std::vector<int> result;
+    std::stringstream stream(cpus);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+      int first, last;
+      int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+      if (n < 1) continue;
+      if (n == 1) last = first;
+      for (int cpu = first; cpu <= last; ++cpu) result.push_back(cpu);
+    }
+    return result;
+  }
+
+  static ThreadsCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    int numWorkers = args->geti(0);
+    const char* cpus = args->gets("");
+    auto dataSize = sizeof(ThreadsCmdData) + strlen(cpus) + 1;
+    ThreadsCmdData* cmdData = (ThreadsCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_threads: alloc failed.\n"); return nullptr; }
+    char* data = (char*) (cmdData + 1);
+    cmdData->numWorkers = numWorkers;
+    cmdData->cpus = copyStrToBuf(&data, cpus);
+    cmdData->policy = args->geti(0);
+    cmdData->priority = args->geti(0);
+    cmdData->intraOpThreads = args->geti(0);
+    cmdData->interOpThreads = args->geti(0);
+    cmdData->lockMemory = args->geti(0);
+    return cmdData;
+  }
+
+  ThreadsCmdData() = delete;
+};
+
+bool nn_threads(World* world, void* inData) {
+  ThreadsCmdData* data = (ThreadsCmdData*)inData;
+  NN::NNPoolSettings settings;
+  settings.numWorkers = data->numWorkers;
+  settings.cpus = ThreadsCmdData::parseCpus(data->cpus);
+  settings.policy = static_cast<NN::NNSchedPolicy>(data->policy);
+  settings.priority = data->priority;
+  settings.intraOpThreads = data->intraOpThreads;
+  bool applied = gWorkerPool.configure(settings);
+  // UGens only hand jobs over to running threads
+  gWorkerPool.start();
+  if (!applied)
+    Print("nn_threads: some settings couldn't be applied to running threads "
+          "(numWorkers can't change after first use, affinity is only supported on linux, "
+          "real-time scheduling needs permissions)\n");
+  if (data->interOpThreads > 0 && !Backend::set_inter_op_threads(data->interOpThreads))
+    Print("nn_threads: inter-op threads can only be set before they're first used\n");
+#if defined(__linux__) || defined(__APPLE__)
+  if (data->lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    Print("nn_threads: couldn't lock memory\n");
+#endif
+  return true;
+}
+
+
 // /nn_unload i
 struct UnloadCmdData {
 public:
@@ -133,53 +290,457 @@ bool nn_unload(World* world, void* inData) {
   UnloadCmdData* data = (UnloadCmdData*)inData;
   int id = data->id;
 
+  if (auto model = gModels.get(static_cast<unsigned short>(id), false))
+    gInstanceCache.clear(model);
   gModels.unload(id);
 
   return true;
 }
 
-// /cmd /nn_warmup int int
-/* struct WarmupCmdData { */
-/* public: */
-/*   int modelIdx; */
-/*   int methodIdx; */
+// /cmd /nn_overload int int int float
+struct OverloadCmdData {
+public:
+  int modelIdx;
+  int policy;
+  int missThreshold;
+  float shedTime;
+
+  static OverloadCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(OverloadCmdData);
+    OverloadCmdData* cmdData = (OverloadCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_overload: alloc failed.\n"); return nullptr; }
+    cmdData->modelIdx = args->geti(-1);
+    cmdData->policy = args->geti(0);
+    cmdData->missThreshold = args->geti(4);
+    cmdData->shedTime = args->getf(2.f);
+    return cmdData;
+  }
 
-/*   static WarmupCmdData* alloc(sc_msg_iter* args, World* world=nullptr) { */
-/*     int modelIdx = args->geti(-1); */
-/*     int methodIdx = args->geti(-1); */
+  OverloadCmdData() = delete;
+};
+
+bool nn_overload(World* world, void* inData) {
+  OverloadCmdData* data = (OverloadCmdData*)inData;
+  if (data->modelIdx < 0) {
+    Print("nn_overload: invalid model index %d\n", data->modelIdx);
+    return true;
+  }
+  auto model = gModels.get(static_cast<unsigned short>(data->modelIdx), true);
+  if (model) model->setOverloadPolicy(data->policy, data->missThreshold, data->shedTime);
+  return true;
+}
+
+// /cmd /nn_cache_dir str
+struct CacheDirCmdData {
+public:
+  const char* dir;
+
+  static CacheDirCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    const char* dir = args->gets("");
+    auto dataSize = sizeof(CacheDirCmdData) + strlen(dir) + 1;
+    CacheDirCmdData* cmdData = (CacheDirCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_cache_dir: alloc failed.\n"); return nullptr; }
+    char* data = (char*) (cmdData + 1);
+    cmdData->dir = copyStrToBuf(&data, dir);
+    return cmdData;
+  }
+
+  CacheDirCmdData() = delete;
+};
+
+bool nn_cache_dir(World* world, void* inData) {
+  CacheDirCmdData* data = (CacheDirCmdData*)inData;
+  gModels.setCacheDir(data->dir);
+  gModelPool.setCacheDir(data->dir);
+  return true;
+}
+
+// /cmd /nn_weights int int
+struct WeightsCmdData {
+public:
+  int mapWeights;
+  int hugePages;
+
+  static WeightsCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(WeightsCmdData);
+    WeightsCmdData* cmdData = (WeightsCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_weights: alloc failed.\n"); return nullptr; }
+    cmdData->mapWeights = args->geti(1);
+    cmdData->hugePages = args->geti(0);
+    return cmdData;
+  }
+
+  WeightsCmdData() = delete;
+};
+
+// weights files are kept next to cached model info
+bool nn_weights(World* world, void* inData) {
+  WeightsCmdData* data = (WeightsCmdData*)inData;
+  if (data->mapWeights && gModels.getCacheDir().empty())
+    Print("nn_weights: no cache directory (see /nn_cache_dir), can't map weights\n");
+  gModelPool.setMapping(data->mapWeights, data->hugePages);
+  return true;
+}
+
+// /cmd /nn_nrt float
+struct NrtCmdData {
+public:
+  float window;
+
+  static NrtCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(NrtCmdData);
+    NrtCmdData* cmdData = (NrtCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_nrt: alloc failed.\n"); return nullptr; }
+    cmdData->window = args->getf(0.f);
+    return cmdData;
+  }
+
+  NrtCmdData() = delete;
+};
+
+// read by UGens created afterwards, on NRT servers only
+bool nn_nrt(World* world, void* inData) {
+  NrtCmdData* data = (NrtCmdData*)inData;
+  gNrtWindow = std::max(0.f, data->window);
+  return true;
+}
+
+// /cmd /nn_warmup int int int int int int
+struct WarmupCmdData {
+public:
+  int modelIdx;
+  int methodIdx;
+  int bufferSize;
+  int batches;
+  int count;
+  int passes;
+
+  static WarmupCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(WarmupCmdData);
+    WarmupCmdData* cmdData = (WarmupCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_warmup: alloc failed.\n"); return nullptr; }
+    cmdData->modelIdx = args->geti(-1);
+    cmdData->methodIdx = args->geti(-1);
+    cmdData->bufferSize = args->geti(-1);
+    cmdData->batches = args->geti(1);
+    cmdData->count = args->geti(1);
+    cmdData->passes = args->geti(1);
+    return cmdData;
+  }
+
+  WarmupCmdData() = delete;
+};
+
+// load instances now, on the NRT thread, for UGens to adopt later
+bool nn_warmup(World* world, void* inData) {
+  WarmupCmdData* data = (WarmupCmdData*)inData;
+  if (data->modelIdx < 0) {
+    Print("nn_warmup: invalid model index %d\n", data->modelIdx);
+    return true;
+  }
+  const auto model = gModels.get(static_cast<unsigned short>(data->modelIdx), true);
+  if (model == nullptr) return true;
+  auto method = model->getMethod(static_cast<unsigned short>(data->methodIdx), true);
+  if (method == nullptr) return true;
+  // same parameters as the UGens that will adopt them
+  NNModelInstance::Key key{model, method, model->getBufferSize(data->bufferSize),
+                           std::max(1, data->batches)};
+  int passes = gInstanceCache.warmup(key, data->count, data->passes);
+  if (passes > 0) {
+    Print("nn_warmup: %s %s (bufferSize %d, batches %d): call time stable after %d passes\n",
+          model->getPath(), method->name.c_str(), std::get<2>(key), std::get<3>(key), passes);
+  }
+  return true;
+}
+
+// /cmd /nn_jit int int int int
+struct JitCmdData {
+public:
+  int modelIdx;
+  int profiling;
+  int fusion;
+  int bailoutDepth;
+
+  static JitCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(JitCmdData);
+    JitCmdData* cmdData = (JitCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_jit: alloc failed.\n"); return nullptr; }
+    cmdData->modelIdx = args->geti(-1);
+    cmdData->profiling = args->geti(-1);
+    cmdData->fusion = args->geti(-1);
+    cmdData->bailoutDepth = args->geti(-1);
+    return cmdData;
+  }
+
+  JitCmdData() = delete;
+};
+
+// applies to methods compiled from now on: warmed instances are dropped,
+// models already playing keep their compiled graphs until freed
+bool nn_jit(World* world, void* inData) {
+  JitCmdData* data = (JitCmdData*)inData;
+  if (data->modelIdx < 0) {
+    Print("nn_jit: invalid model index %d\n", data->modelIdx);
+    return true;
+  }
+  auto model = gModels.get(static_cast<unsigned short>(data->modelIdx), true);
+  if (model == nullptr) return true;
+  model->setJit(data->profiling, data->fusion, data->bailoutDepth);
+  gInstanceCache.clear(model);
+  return true;
+}
+
+// /cmd /nn_process_buf int int int int int int int
+// runs a model method over a whole buffer on a thread of its own, so that
+// other commands run meanwhile. The source is split in `batches`
+// contiguous segments, processed together as batches of chunkSize samples
+struct ProcessBufJob;
+
+struct ProcessBufCmdData {
+public:
+  int id;
+  int modelIdx;
+  int methodIdx;
+  int srcBufnum;
+  int dstBufnum;
+  int batches;
+  int chunkSize;
+  // created by the first NRT stage
+  ProcessBufJob* job;
+
+  static ProcessBufCmdData* alloc(sc_msg_iter* args, World* world=nullptr) {
+    auto dataSize = sizeof(ProcessBufCmdData);
+    ProcessBufCmdData* cmdData = (ProcessBufCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize));
+    if (cmdData == nullptr) { Print("nn_process_buf: alloc failed.\n"); return nullptr; }
+    cmdData->id = args->geti(-1);
+    cmdData->modelIdx = args->geti(-1);
+    cmdData->methodIdx = args->geti(-1);
+    cmdData->srcBufnum = args->geti(-1);
+    cmdData->dstBufnum = args->geti(-1);
+    cmdData->batches = std::max(1, args->geti(1));
+    cmdData->chunkSize = args->geti(65536);
+    cmdData->job = nullptr;
+    return cmdData;
+  }
+
+  ProcessBufCmdData() = delete;
+};
+
+// buffers can be changed by other commands while processing: check them every time
+static SndBuf* getProcessBuf(World* world, int bufnum, int channels, const char* what) {
+  if (bufnum < 0 || static_cast<uint32_t>(bufnum) >= world->mNumSndBufs) {
+    Print("nn_process_buf: invalid %s buffer %d\n", what, bufnum);
+    return nullptr;
+  }
+  SndBuf* buf = World_GetNRTBuf(world, bufnum);
+  if (buf->data == nullptr || buf->channels != channels) {
+    Print("nn_process_buf: %s buffer %d needs %d channels, has %d\n",
+          what, bufnum, channels, buf->channels);
+    return nullptr;
+  }
+  return buf;
+}
+
+// created and destroyed on the NRT thread. The source is copied and the model
+// info pinned when starting, the job's thread loads its own instance and
+// processes chunks into its own output, publishing progress every
+// publishInterval. The NRT stage waits up to pollWait for it, and copies
+// published chunks to the destination buffer
+struct ProcessBufJob {
+  static constexpr auto publishInterval = std::chrono::milliseconds(100);
+  static constexpr auto pollWait = std::chrono::milliseconds(20);
+
+  // /nn_unload or /nn_load meanwhile replace it instead of deleting it
+  std::shared_ptr<const NNModelDesc> model;
+  const NNModelMethod* method = nullptr;
+  int batches = 1;
+  int chunkSize = 0;
+  int frames = 0;
+  int dstFrames = 0;
+  int segmentSize = 0;
+  int numChunks = 0;
+  // interleaved, as server buffers
+  std::vector<float> src, dst;
+  std::thread thread;
+  // chunks processed and published by the thread, and copied to the
+  // destination by the NRT stage
+  std::atomic<int> processed = 0;
+  int copied = 0;
+  std::atomic<bool> failed = false;
+  std::atomic<bool> cancel = false;
+  std::mutex mutex;
+  std::condition_variable published;
+  // last progress sent, by the RT stage
+  float reported = 0.f;
+
+  ~ProcessBufJob() {
+    cancel = true;
+    if (thread.joinable()) thread.join();
+  }
+
+  bool done() const { return failed || copied >= numChunks; }
+  float progress() const {
+    if (failed) return -1.f;
+    return numChunks > 0 ? static_cast<float>(copied) / numChunks : 1.f;
+  }
+
+  bool start(World* world, const ProcessBufCmdData* data) {
+    if (gModels.get(static_cast<unsigned short>(data->modelIdx), true) == nullptr) return false;
+    model = gModels.pin(static_cast<unsigned short>(data->modelIdx));
+    method = model->getMethod(static_cast<unsigned short>(data->methodIdx), true);
+    if (method == nullptr) return false;
+    SndBuf* srcBuf = getProcessBuf(world, data->srcBufnum, method->inDim, "source");
+    SndBuf* dstBuf = getProcessBuf(world, data->dstBufnum, method->outDim, "destination");
+    if (srcBuf == nullptr || dstBuf == nullptr) return false;
+    batches = data->batches;
+    chunkSize = model->getBufferSize(data->chunkSize);
+    frames = srcBuf->frames;
+    dstFrames = dstBuf->frames;
+    segmentSize = (frames + batches - 1) / batches;
+    numChunks = (segmentSize + chunkSize - 1) / chunkSize;
+    src.assign(srcBuf->data, srcBuf->data + static_cast<size_t>(frames) * method->inDim);
+    dst.assign(static_cast<size_t>(dstFrames) * method->outDim, 0.f);
+    thread = std::thread(&ProcessBufJob::run, this);
+    return true;
+  }
+
+  void run() {
+    // not given back to the cache: keyed by model info that only lives as
+    // long as the job
+    std::unique_ptr<NNModelInstance> instance(
+        gInstanceCache.create({model.get(), method, chunkSize, batches}, 0));
+    if (instance == nullptr) {
+      publish(0, true);
+      return;
+    }
+    std::vector<float> in(method->inDim * batches * instance->prepared.in_frames());
+    std::vector<float> out(method->outDim * batches * instance->prepared.out_frames());
+    auto lastPublished = std::chrono::steady_clock::now();
+    for (int chunk = 0; chunk < numChunks && !cancel; ++chunk) {
+      processChunk(*instance, chunk, in, out);
+      auto now = std::chrono::steady_clock::now();
+      if (chunk + 1 == numChunks || now - lastPublished >= publishInterval) {
+        publish(chunk + 1, false);
+        lastPublished = now;
+      }
+    }
+  }
+
+  void publish(int chunks, bool fail) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      processed.store(chunks, std::memory_order_release);
+      if (fail) failed = true;
+    }
+    published.notify_one();
+  }
+
+  // NRT stage: wait a little for chunks processed since the last copy
+  void waitPublished() {
+    std::unique_lock<std::mutex> lock(mutex);
+    published.wait_for(lock, pollWait, [this] {
+      return failed || processed.load(std::memory_order_relaxed) != copied;
+    });
+  }
+
+  // model rate frames (see PreparedMethod::decimated)
+  // in: [inDim][batches][inFrames], out: [batches][outDim][outFrames]
+  void processChunk(NNModelInstance& instance, int chunk, std::vector<float>& in,
+                    std::vector<float>& out) {
+    int inDim = method->inDim, outDim = method->outDim;
+    int inRatio = method->inRatio, outRatio = method->outRatio;
+    int inFrames = instance.prepared.in_frames();
+    int outFrames = instance.prepared.out_frames();
+    int offset = chunk * chunkSize;
+    for (int b = 0; b < batches; ++b) {
+      int start = b * segmentSize + offset;
+      // past the end of this segment or of the source: zeros
+      int n = std::clamp(std::min(segmentSize - offset, frames - start), 0, chunkSize);
+      // the model takes the last sample of every inRatio
+      int modelFrames = n / inRatio;
+      for (int d = 0; d < inDim; ++d) {
+        float* row = &in[(d * batches + b) * inFrames];
+        for (int i = 0; i < modelFrames; ++i)
+          row[i] = src[(start + i * inRatio + inRatio - 1) * inDim + d];
+        std::fill(row + modelFrames, row + inFrames, 0.f);
+      }
+    }
+    instance.model.perform(instance.prepared, in.data(), out.data());
+    for (int b = 0; b < batches; ++b) {
+      int start = b * segmentSize + offset;
+      int n = std::clamp(std::min(segmentSize - offset, dstFrames - start), 0, chunkSize);
+      // each output frame is held for outRatio samples
+      for (int d = 0; d < outDim; ++d) {
+        const float* row = &out[(b * outDim + d) * outFrames];
+        for (int i = 0; i < n; ++i) dst[(start + i) * outDim + d] = row[i / outRatio];
+      }
+    }
+  }
+
+  // copy chunks processed since last time to the destination buffer
+  bool copyProcessed(World* world, int dstBufnum) {
+    int chunks = processed.load(std::memory_order_acquire);
+    if (chunks == copied) return true;
+    SndBuf* dstBuf = getProcessBuf(world, dstBufnum, method->outDim, "destination");
+    if (dstBuf == nullptr || dstBuf->frames != dstFrames) return false;
+    int outDim = method->outDim;
+    for (int b = 0; b < batches; ++b) {
+      int first = std::min(b * segmentSize + copied * chunkSize, std::min((b + 1) * segmentSize, dstFrames));
+      int last = std::min(b * segmentSize + chunks * chunkSize, std::min((b + 1) * segmentSize, dstFrames));
+      if (last > first)
+        std::copy(&dst[first * outDim], &dst[last * outDim], &dstBuf->data[first * outDim]);
+    }
+    copied = chunks;
+    return true;
+  }
+};
+
+// NRT stage: copy the source and start processing
+bool nn_process_buf(World* world, void* inData) {
+  ProcessBufCmdData* data = (ProcessBufCmdData*)inData;
+  data->job = new ProcessBufJob();
+  if (!data->job->start(world, data)) data->job->failed = true;
+  return true;
+}
+
+// NRT stage: copy what was published meanwhile to the destination, waiting
+// a little for it: the RT stage is only queued again every pollWait or so
+bool nn_process_buf_poll(World* world, void* inData) {
+  ProcessBufCmdData* data = (ProcessBufCmdData*)inData;
+  auto job = data->job;
+  job->waitPublished();
+  if (!job->failed && !job->copyProcessed(world, data->dstBufnum)) job->failed = true;
+  return true;
+}
+
+// NRT stage: stop processing if failed, and unpin the model info
+bool nn_process_buf_free(World* world, void* inData) {
+  ProcessBufCmdData* data = (ProcessBufCmdData*)inData;
+  delete data->job;
+  NRTFree(data);
+  return false;
+}
+
+// RT stage: report progress when it changed, then poll again until done.
+// Reports are at most every publishInterval, and at the end.
+// Replies go to all clients registered with /notify, like SendReply:
+// [/nn_process_buf, 0, id, progress], progress is 1 when done, -1 on failure
+bool nn_process_buf_next(World* world, void* inData) {
+  ProcessBufCmdData* data = (ProcessBufCmdData*)inData;
+  auto job = data->job;
+  float progress = job->progress();
+  if (progress != job->reported || job->done()) {
+    // the root group, with node ID 0
+    SendNodeReply(reinterpret_cast<Node*>(world->mTopGroup), data->id, "/nn_process_buf", 1, &progress);
+    job->reported = progress;
+  }
+  if (job->done())
+    DoAsynchronousCommand(world, nullptr, "", data, nn_process_buf_free, nullptr, nullptr, nullptr, 0, 0);
+  else
+    DoAsynchronousCommand(world, nullptr, "", data, nn_process_buf_poll, nn_process_buf_next, nullptr, nullptr, 0, 0);
+  return false;
+}
 
-/*     auto dataSize = sizeof(WarmupCmdData); */
-/*     WarmupCmdData* cmdData = (WarmupCmdData*) (world ? RTAlloc(world, dataSize) : NRTAlloc(dataSize)); */
-/*     if (cmdData == nullptr) { Print("nn_warmup: alloc failed.\n"); return nullptr; } */
-/*     cmdData->modelIdx = modelIdx; */
-/*     cmdData->methodIdx = methodIdx; */
-    
-/*     return cmdData; */
-/*   } */
-
-/*   WarmupCmdData() = delete; */
-/* }; */
-
-/* bool nn_warmup(World* world, void* inData) { */
-/*   WarmupCmdData* data = (WarmupCmdData*)inData; */
-/*   int modelIdx = data->modelIdx; */
-/*   int methodIdx = data->methodIdx; */
-/*   if (modelIdx < 0) { */
-/*     Print("nn_warmup: invalid model index %d\n", modelIdx); */
-/*     return true; */
-/*   } */
-/*   const auto model = gModels.get(static_cast<unsigned short>(modelIdx), true); */
-/*   if (model) { */
-/*     if (methodIdx < 0) { */
-/*       // warmup all methods */
-/*       for(auto method: model->m_methods) model->warmup_method(&method); */
-/*     } else { */
-/*       auto method = model->getMethod(methodIdx, true); */
-/*       if (method) model->warmup_method(method); */
-/*     } */
-/*   } */
-/*   return true; */
-/* } */
 void nrtFree(World*, void* data) { NRTFree(data); }
 
 template<class CmdData, auto cmdFn>
@@ -195,11 +756,29 @@ void asyncCmd(World* world, void* inUserData, sc_msg_iter* args, void* replyAddr
     nrtFree, 0, 0);
 }
 
+void processBufCmd(World* world, void* inUserData, sc_msg_iter* args, void* replyAddr) {
+  auto data = ProcessBufCmdData::alloc(args);
+  if (data == nullptr) return;
+  // the command polls its job until done, and frees its data
+  DoAsynchronousCommand(
+    world, replyAddr, "", data,
+    nn_process_buf, nn_process_buf_next, nullptr,
+    nullptr, 0, 0);
+}
+
 void definePlugInCmds() {
   DefinePlugInCmd("/nn_load", asyncCmd<LoadCmdData, nn_load>, nullptr);
   DefinePlugInCmd("/nn_query", asyncCmd<QueryCmdData, nn_query>, nullptr);
+  DefinePlugInCmd("/nn_stats", asyncCmd<StatsCmdData, nn_stats>, nullptr);
   DefinePlugInCmd("/nn_unload", asyncCmd<UnloadCmdData, nn_unload>, nullptr);
-  /* DefinePlugInCmd("/nn_warmup", asyncCmd<WarmupCmdData, nn_warmup>, nullptr); */
+  DefinePlugInCmd("/nn_overload", asyncCmd<OverloadCmdData, nn_overload>, nullptr);
+  DefinePlugInCmd("/nn_threads", asyncCmd<ThreadsCmdData, nn_threads>, nullptr);
+  DefinePlugInCmd("/nn_warmup", asyncCmd<WarmupCmdData, nn_warmup>, nullptr);
+  DefinePlugInCmd("/nn_jit", asyncCmd<JitCmdData, nn_jit>, nullptr);
+  DefinePlugInCmd("/nn_nrt", asyncCmd<NrtCmdData, nn_nrt>, nullptr);
+  DefinePlugInCmd("/nn_cache_dir", asyncCmd<CacheDirCmdData, nn_cache_dir>, nullptr);
+  DefinePlugInCmd("/nn_weights", asyncCmd<WeightsCmdData, nn_weights>, nullptr);
+  DefinePlugInCmd("/nn_process_buf", processBufCmd, nullptr);
 }
 
 } // namespace NN::Cmd
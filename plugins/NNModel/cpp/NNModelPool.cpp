@@ -0,0 +1,79 @@
+#include "NNModelPool.hpp"
+#include "SC_InterfaceTable.h"
+#include <filesystem>
+#include <functional>
+#include <sstream>
+
+extern InterfaceTable* ft;
+
+namespace NN {
+
+// files derived from a model, one per model path and conversion
+static std::string getCacheFile(const std::string& dir, const char* path,
+                                const LoadOptions& options, const char* extension) {
+  static const char* precisionNames[] = {"", ".bf16", ".int8"};
+  std::stringstream name;
+  name << std::hex << std::hash<std::string>{}(path)
+    << precisionNames[static_cast<int>(options.precision)]
+    << (options.optimize ? ".opt" : "") << extension;
+  return (std::filesystem::path(dir) / name.str()).string();
+}
+
+void NNModelPool::setMapping(bool mapWeights, bool hugePages) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_mapWeights = mapWeights;
+  m_hugePages = hugePages;
+}
+
+void NNModelPool::setCacheDir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_cacheDir = dir;
+}
+
+SharedModule NNModelPool::acquire(const NNModelDesc* model, Precision* precision) {
+  std::shared_ptr<Entry> entry;
+  LoadOptions options;
+  options.precision = static_cast<Precision>(model->getPrecision());
+  options.optimize = model->getOptimize();
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_cacheDir.empty()) {
+      if (options.precision != Precision::fp32 || options.optimize)
+        options.converted_file = getCacheFile(m_cacheDir, model->getPath(), options, ".ts");
+      if (m_mapWeights)
+        options.weights_file = getCacheFile(m_cacheDir, model->getPath(), options, ".weights");
+    }
+    options.huge_pages = m_hugePages;
+    // forget models that were freed, unless someone is loading them
+    std::erase_if(m_entries, [](const auto& kv) {
+      return kv.second->module.expired() && kv.second.use_count() == 1;
+    });
+    auto& slot = m_entries[{model->getId(), model->getPath(), options.precision, options.optimize}];
+    if (slot == nullptr) slot = std::make_shared<Entry>();
+    entry = slot;
+  }
+
+  // load outside of the pool lock, so that different models can load in parallel
+  std::lock_guard<std::mutex> lock(entry->mutex);
+  if (auto module = entry->module.lock()) {
+    if (precision) *precision = entry->precision;
+    return module;
+  }
+  auto module = Backend::load_module(model->getPath(), options, entry->precision);
+  if (module == nullptr) {
+    Print("NNModelPool: can't load model %s\n", model->getPath());
+    return nullptr;
+  }
+  entry->module = module;
+  if (precision) *precision = entry->precision;
+  return module;
+}
+
+bool NNModelPool::load(const NNModelDesc* model, Backend& backend) {
+  Precision precision;
+  auto module = acquire(model, &precision);
+  if (module == nullptr) return false;
+  return backend.load(module, model->getPath(), precision) == 0;
+}
+
+} // namespace NN
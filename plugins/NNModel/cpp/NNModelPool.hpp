@@ -0,0 +1,61 @@
+// NNModelPool.hpp
+
+#pragma once
+#include "NNModel.hpp"
+#include "backend/backend.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace NN {
+
+using SharedModule = std::shared_ptr<const torch::jit::script::Module>;
+
+// executor settings to warm up a model with (see /nn_jit)
+inline JitSettings getJitSettings(const NNModelDesc* model) {
+  JitSettings settings;
+  settings.profiling = model->getJitProfiling();
+  settings.fusion = model->getJitFusion();
+  settings.bailout_depth = model->getJitBailoutDepth();
+  return settings;
+}
+
+// refcounted store of loaded torchscripts, keyed by model (id + path):
+// weights are loaded from disk only once and shared by all UGens using
+// the same model, then freed when the last one is gone
+class NNModelPool {
+public:
+  // get shared weights for a model, loading them if needed, and the precision
+  // they were loaded with. Returns nullptr if the model can't be loaded
+  SharedModule acquire(const NNModelDesc* model, Precision* precision = nullptr);
+  // load backend as an independent execution context of model:
+  // weights are shared, per-instance state (e.g. streaming buffers) is not
+  bool load(const NNModelDesc* model, Backend& backend);
+
+  // models loaded from now on get their weights memory mapped from a copy in
+  // the cache dir, shared between processes; or copied to huge pages, private
+  void setMapping(bool mapWeights, bool hugePages);
+  // where weights copies and converted models are kept, empty to disable
+  void setCacheDir(const std::string& dir);
+
+private:
+  struct Entry {
+    std::mutex mutex;
+    std::weak_ptr<const torch::jit::script::Module> module;
+    // the model's precision, or fp32 if it can't run in it
+    Precision precision = Precision::fp32;
+  };
+  // model id, path, requested precision, optimized
+  using Key = std::tuple<unsigned short, std::string, Precision, bool>;
+
+  std::mutex m_mutex;
+  std::map<Key, std::shared_ptr<Entry>> m_entries;
+  bool m_mapWeights = false;
+  std::atomic<bool> m_hugePages = false;
+  std::string m_cacheDir;
+};
+
+} // namespace NN
@@ -0,0 +1,187 @@
+#include "NNStats.hpp"
+#include "backend/backend.h"
+#include "SC_InterfaceTable.h"
+#include <algorithm>
+#include <bit>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+extern InterfaceTable* ft;
+
+namespace NN {
+
+static const char* stageNames[numStages] = {
+  "attributes", "input", "forward", "output", "compute"
+};
+static const char* counterNames[numCounters] = {
+  "windows", "missed", "dropped", "underruns", "shed"
+};
+
+template <class T>
+static void atomicMax(std::atomic<T>& value, T newValue) {
+  T current = value.load(std::memory_order_relaxed);
+  while (newValue > current
+         && !value.compare_exchange_weak(current, newValue, std::memory_order_relaxed)) {}
+}
+
+// HISTOGRAM
+
+void NNHistogram::record(std::chrono::steady_clock::duration duration) {
+  auto us = static_cast<uint64_t>(std::max<int64_t>(0,
+    std::chrono::duration_cast<std::chrono::microseconds>(duration).count()));
+  // bucket i holds durations below 2^i us
+  int bucket = std::min<int>(std::bit_width(us), numBuckets - 1);
+  m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_sumUs.fetch_add(us, std::memory_order_relaxed);
+  atomicMax(m_maxUs, us);
+}
+
+void NNHistogram::reset() {
+  for (auto& bucket: m_buckets) bucket = 0;
+  m_count = 0;
+  m_sumUs = 0;
+  m_maxUs = 0;
+}
+
+double NNHistogram::meanUs() const {
+  auto n = count();
+  return n > 0 ? static_cast<double>(m_sumUs.load(std::memory_order_relaxed)) / n : 0.;
+}
+
+uint64_t NNHistogram::quantileUs(double quantile) const {
+  uint64_t n = count();
+  if (n == 0) return 0;
+  auto target = static_cast<uint64_t>(quantile * n);
+  uint64_t seen = 0;
+  for (int i = 0; i < numBuckets - 1; ++i) {
+    seen += m_buckets[i].load(std::memory_order_relaxed);
+    if (seen > target) return std::min(uint64_t(1) << i, maxUs());
+  }
+  return maxUs();
+}
+
+// STATS
+
+void NNStats::record(NNStage stage, std::chrono::steady_clock::duration duration) {
+  m_stages[stage].record(duration);
+  if (auto parent = this->parent()) parent->record(stage, duration);
+}
+
+void NNStats::record(const PerformTimings& timings) {
+  record(stageInput, timings.input);
+  record(stageForward, timings.forward);
+  record(stageOutput, timings.output);
+}
+
+void NNStats::count(NNCounter counter, uint64_t n) {
+  m_counters[counter].fetch_add(n, std::memory_order_relaxed);
+  if (auto parent = this->parent()) parent->count(counter, n);
+}
+
+void NNStats::queueDepth(int inFlight) {
+  m_queueDepthSum.fetch_add(inFlight, std::memory_order_relaxed);
+  m_queueDepthCount.fetch_add(1, std::memory_order_relaxed);
+  atomicMax(m_queueDepthMax, inFlight);
+  if (auto parent = this->parent()) parent->queueDepth(inFlight);
+}
+
+void NNStats::reset() {
+  for (auto& stage: m_stages) stage.reset();
+  for (auto& counter: m_counters) counter = 0;
+  m_queueDepthSum = 0;
+  m_queueDepthCount = 0;
+  m_queueDepthMax = 0;
+}
+
+void NNStats::streamInfo(std::ostream& stream, const char* indent) const {
+  for (int i = 0; i < numCounters; ++i)
+    stream << "\n" << indent << counterNames[i] << ": " << m_counters[i].load(std::memory_order_relaxed);
+  auto depthCount = m_queueDepthCount.load(std::memory_order_relaxed);
+  double depthMean = depthCount > 0 ? static_cast<double>(m_queueDepthSum.load(std::memory_order_relaxed)) / depthCount : 0.;
+  stream << "\n" << indent << "queueDepth:"
+    << "\n" << indent << "  mean: " << depthMean
+    << "\n" << indent << "  max: " << m_queueDepthMax.load(std::memory_order_relaxed);
+  stream << "\n" << indent << "stages:";
+  for (int i = 0; i < numStages; ++i) {
+    const auto& h = m_stages[i];
+    stream << "\n" << indent << "  " << stageNames[i] << ":"
+      << "\n" << indent << "    count: " << h.count()
+      << "\n" << indent << "    meanUs: " << h.meanUs()
+      << "\n" << indent << "    p50Us: " << h.quantileUs(0.5)
+      << "\n" << indent << "    p99Us: " << h.quantileUs(0.99)
+      << "\n" << indent << "    maxUs: " << h.maxUs();
+  }
+}
+
+// REGISTRY
+
+NNStats* NNStatsRegistry::model(unsigned short modelIdx) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto& stats = m_models[modelIdx];
+  if (!stats) stats = std::make_unique<NNStats>();
+  return stats.get();
+}
+
+void NNStatsRegistry::add(NNStats* stats, unsigned short modelIdx, int nodeId) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_instances.push_back({stats, modelIdx, nodeId});
+}
+
+void NNStatsRegistry::remove(const NNStats* stats) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::erase_if(m_instances, [stats](const Instance& i) { return i.stats == stats; });
+}
+
+void NNStatsRegistry::streamInfo(std::ostream& stream, int modelIdx) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const auto& [idx, stats]: m_models) {
+    if (modelIdx >= 0 && idx != modelIdx) continue;
+    stream << "- idx: " << idx;
+    stats->streamInfo(stream, "  ");
+    stream << "\n  instances:";
+    for (const auto& instance: m_instances) {
+      if (instance.modelIdx != idx) continue;
+      stream << "\n    - nodeId: " << instance.nodeId;
+      instance.stats->streamInfo(stream, "      ");
+    }
+    stream << "\n";
+  }
+}
+
+bool NNStatsRegistry::dumpInfo(const char* filename, int modelIdx) const {
+  std::ostringstream snapshot;
+  streamInfo(snapshot, modelIdx);
+  try {
+    std::ofstream file;
+    file.open(filename);
+    if (!file.is_open()) {
+      Print("ERROR: NNStats couldn't open file %s\n", filename);
+      return false;
+    }
+    file << snapshot.str();
+    file.close();
+    return true;
+  }
+  catch (...) {
+    Print("ERROR: NNStats couldn't dump stats to file %s\n", filename);
+    return false;
+  }
+}
+
+void NNStatsRegistry::printInfo(int modelIdx) const {
+  std::ostringstream snapshot;
+  streamInfo(snapshot, modelIdx);
+  std::cout << snapshot.str() << std::endl;
+}
+
+void NNStatsRegistry::reset(int modelIdx) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& [idx, stats]: m_models)
+    if (modelIdx < 0 || idx == modelIdx) stats->reset();
+  for (auto& instance: m_instances)
+    if (modelIdx < 0 || instance.modelIdx == modelIdx) instance.stats->reset();
+}
+
+} // namespace NN
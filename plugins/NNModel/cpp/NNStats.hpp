@@ -0,0 +1,122 @@
+// NNStats.hpp
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+struct PerformTimings;
+
+namespace NN {
+
+// lock-free latency histogram, with power of two buckets of microseconds
+class NNHistogram {
+public:
+  // last bucket holds everything above ~8s
+  static constexpr int numBuckets = 24;
+
+  void record(std::chrono::steady_clock::duration duration);
+  void reset();
+
+  uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+  double meanUs() const;
+  uint64_t maxUs() const { return m_maxUs.load(std::memory_order_relaxed); }
+  // upper bound of the bucket containing the given quantile (0 to 1)
+  uint64_t quantileUs(double quantile) const;
+
+private:
+  std::array<std::atomic<uint64_t>, numBuckets> m_buckets{};
+  std::atomic<uint64_t> m_count = 0;
+  std::atomic<uint64_t> m_sumUs = 0;
+  std::atomic<uint64_t> m_maxUs = 0;
+};
+
+enum NNStage {
+  stageAttributes = 0,
+  stageInput,
+  stageForward,
+  stageOutput,
+  // whole window processing, including the above
+  stageCompute,
+  numStages
+};
+
+enum NNCounter {
+  // windows computed
+  countWindows = 0,
+  // windows computed after their deadline
+  countMissed,
+  // windows dropped because all queue slots were busy
+  countDropped,
+  // output samples that were due before being computed
+  countUnderruns,
+  // times the instance was shed by the overload policy
+  countShed,
+  numCounters
+};
+
+// timings and counters of an instance or a model.
+// Recording is lock-free, and also records to the parent stats if any
+class NNStats {
+public:
+  explicit NNStats(NNStats* parent=nullptr): m_parent(parent) {}
+
+  // set once registered (see NNStatsRegistry::model), while recording
+  void setParent(NNStats* parent) { m_parent.store(parent, std::memory_order_release); }
+
+  void record(NNStage stage, std::chrono::steady_clock::duration duration);
+  // record the steps of a Backend::perform call
+  void record(const PerformTimings& timings);
+  void count(NNCounter counter, uint64_t n=1);
+  // windows in flight when a window is submitted
+  void queueDepth(int inFlight);
+  void reset();
+
+  void streamInfo(std::ostream& stream, const char* indent) const;
+
+private:
+  NNStats* parent() const { return m_parent.load(std::memory_order_acquire); }
+
+  std::atomic<NNStats*> m_parent;
+  std::array<NNHistogram, numStages> m_stages;
+  std::array<std::atomic<uint64_t>, numCounters> m_counters{};
+  std::atomic<uint64_t> m_queueDepthSum = 0;
+  std::atomic<uint64_t> m_queueDepthCount = 0;
+  std::atomic<int> m_queueDepthMax = 0;
+};
+
+// all model and instance stats, for /nn_stats
+class NNStatsRegistry {
+public:
+  // model stats are never freed, so that instances can keep pointers to them.
+  // Registering locks and allocates: not on the audio thread
+  NNStats* model(unsigned short modelIdx);
+  // instance stats must be removed before they're destroyed
+  void add(NNStats* stats, unsigned short modelIdx, int nodeId);
+  void remove(const NNStats* stats);
+
+  // modelIdx < 0: all models. Holds the lock while streaming: dumpInfo and
+  // printInfo stream a snapshot, so that file and console output don't block UGens
+  void streamInfo(std::ostream& stream, int modelIdx) const;
+  bool dumpInfo(const char* filename, int modelIdx) const;
+  void printInfo(int modelIdx) const;
+  void reset(int modelIdx);
+
+private:
+  struct Instance {
+    NNStats* stats;
+    unsigned short modelIdx;
+    int nodeId;
+  };
+  mutable std::mutex m_mutex;
+  std::map<unsigned short, std::unique_ptr<NNStats>> m_models;
+  std::vector<Instance> m_instances;
+};
+
+} // namespace NN
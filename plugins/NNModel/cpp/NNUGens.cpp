@@ -1,17 +1,36 @@
 // NNUGens.cpp
 #include "NNModel.hpp"
+#include "NNModelPool.hpp"
+#include "NNInstanceCache.hpp"
 #include "NNUGens.hpp"
 #include "NNModelCmd.hpp"
 #include "SC_Unit.h"
-#include "rt_circular_buffer.h"
 #include "SC_InterfaceTable.h"
 #include "SC_PlugIn.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 
 InterfaceTable* ft;
 
 // global model store, by numeric id
 NN::NNModelDescLib gModels;
+// loaded weights, shared by all UGens playing the same model
+NN::NNModelPool gModelPool;
+// batched inference shared by UGens playing the same model method
+NN::NNBatchScheduler gBatchScheduler;
+// timings and counters by model and instance, for /nn_stats
+NN::NNStatsRegistry gStats;
+// warmed model instances, adopted by new UGens
+NN::NNInstanceCache gInstanceCache;
+// compute threads shared by all UGens, destroyed first
+NN::NNWorkerPool gWorkerPool;
+// NRT processing window in seconds, set by /nn_nrt. 0: UGens' bufferSize
+std::atomic<float> gNrtWindow = 0.f;
+// adaptive buffer size: windows in a row that could have been computed at a
+// smaller size before shrinking, see NN::adapt
+static constexpr int adaptShrinkWindows = 32;
 
 /* #define DEBUG */
 #ifdef DEBUG
@@ -41,8 +60,8 @@ void NNUGen::clearOutputs(int nSamples) {
 }
 
 // ATTRIBUTES
-NNSetAttr::NNSetAttr(const NNModelAttribute* attr, int inputIdx, float initVal):
-    attr(attr), inputIdx(inputIdx), value(initVal), valUpdated(true) {}
+NNSetAttr::NNSetAttr(const NNModelAttribute* attr, int attrIdx, int inputIdx, float initVal):
+    attr(attr), attrIdx(attrIdx), inputIdx(inputIdx), value(initVal), valUpdated(true) {}
 
 void NNSetAttr::update(Unit* unit, int nSamples) {
   float newval = IN0(inputIdx);
@@ -54,13 +73,15 @@ void NNSetAttr::update(Unit* unit, int nSamples) {
 
 // attributes are provided as additional input pairs (attrId, val) after model inputs
 void NNUGen::setupAttributes() {
-  int i = UGenInputs::inputs + m_inDim * m_batches;
+  int i = m_attrInput;
   while (i < numInputs()) {
     int attrIdx = in0(i);
     auto attr = m_sharedData->m_modelDesc->getAttribute(attrIdx, true);
-    if (attr != nullptr) {
+    if (attr != nullptr && attr->type == NNAttributeType::typeOther) {
+      Print("NNUGen: attribute %s is not a number, can't be set\n", attr->name.c_str());
+    } else if (attr != nullptr) {
       int inputIdx = i + 1;
-      NNSetAttr setter(attr, inputIdx, in0(inputIdx));
+      NNSetAttr setter(attr, attrIdx, inputIdx, in0(inputIdx));
       m_sharedData->m_attributes.push_back(setter);
     } else {
       Print("NNUGen: attribute #%d not found\n", attrIdx);
@@ -69,15 +90,85 @@ void NNUGen::setupAttributes() {
   }
 }
 
+// chained methods are provided after model inputs, before attributes:
+// (modelIdx, methodIdx, scale by input dimension, offset by input dimension) each.
+// Returns the last method, or nullptr if one doesn't take the previous one's outputs
+const NNModelMethod* NNUGen::checkChain(const NNModelMethod* method, int& higherRatio) {
+  int i = UGenInputs::inputs + m_inDim * m_batches;
+  for (int s = 0; s < m_chainLength; ++s) {
+    if (i + 1 >= numInputs()) return nullptr;
+    auto model = gModels.get(static_cast<unsigned short>(in0(i)));
+    auto next = model ? getModelMethod(model, in0(i + 1)) : nullptr;
+    if (next == nullptr) return nullptr;
+    if (next->inDim != method->outDim || next->inRatio != method->outRatio) {
+      Print("NNUGen: chained method %s doesn't take %s outputs\n", next->name.c_str(), method->name.c_str());
+      return nullptr;
+    }
+    higherRatio = sc_max(higherRatio, model->getHigherRatio());
+    method = next;
+    i += 2 + 2 * next->inDim;
+  }
+  m_attrInput = i;
+  return method;
+}
+
+// once checked, see checkChain
+// on the audio thread: stages are RT memory. Returns false if it's exhausted
+bool NNUGen::setupChain() {
+  if (m_chainLength == 0) return true;
+  int firstInput = UGenInputs::inputs + m_inDim * m_batches;
+  int numValues = 0;
+  for (int s = 0, i = firstInput; s < m_chainLength; ++s) {
+    int dim = getModelMethod(gModels.get(static_cast<unsigned short>(in0(i))), in0(i + 1))->inDim;
+    numValues += 2 * dim;
+    i += 2 + 2 * dim;
+  }
+  auto stages = rtAlloc<NNChainStage>(mWorld, m_chainLength);
+  float* values = rtAlloc<float>(mWorld, numValues);
+  if (stages == nullptr || values == nullptr) {
+    RTFree(mWorld, stages);
+    RTFree(mWorld, values);
+    return false;
+  }
+  float* stageValues = values;
+  for (int s = 0, i = firstInput; s < m_chainLength; ++s) {
+    auto& stage = *new(&stages[s]) NNChainStage();
+    stage.model = gModels.get(static_cast<unsigned short>(in0(i)));
+    stage.method = getModelMethod(stage.model, in0(i + 1));
+    stage.inputIdx = i + 2;
+    int dim = stage.method->inDim;
+    stage.scale = stageValues;
+    stage.offset = stageValues + dim;
+    stageValues += 2 * dim;
+    i += 2 + 2 * dim;
+  }
+  m_sharedData->m_chain = {stages, static_cast<size_t>(m_chainLength)};
+  m_sharedData->m_chainValues = values;
+  updateChain();
+  return true;
+}
+
+void NNUGen::updateChain() {
+  for (auto& stage: m_sharedData->m_chain) {
+    int dim = stage.method->inDim;
+    for (int d = 0; d < dim; ++d) {
+      stage.scale[d] = in0(stage.inputIdx + d);
+      stage.offset[d] = in0(stage.inputIdx + dim + d);
+    }
+  }
+}
+
+// apply all attributes that changed since last window
 static void model_perform_attributes(NN* nn_instance) {
+  auto instance = nn_instance->m_instance;
   for(auto& attr: nn_instance->m_attributes) {
     if (!attr.changed()) continue;
     const char* attrName = attr.getName();
     try {
-      nn_instance->m_model.set_attribute(attrName, {attr.getStrValue()});
+      instance->model.set_attribute(instance->setters[attr.attrIdx], {attr.getValue()});
       // print attr value if debugging
       if (nn_instance->m_debug >= Debug::attributes) {
-        auto currVal = nn_instance->m_model.get_attribute_as_string(attrName);
+        auto currVal = instance->model.get_attribute_as_string(attrName);
         Print("%s: %s\n", attrName, currVal.c_str());
       }
     } catch (...) {
@@ -88,144 +179,742 @@ static void model_perform_attributes(NN* nn_instance) {
 
 // PERFORM
 
+// load an instance, unless one was adopted from the cache
 void model_perform_load(NN* nn, int warmup) {
   auto path = nn->m_modelDesc->getPath();
-  if (nn->m_debug >= Debug::all)
-    Print("NNUGen: loading model %s\n", path);
-  int err = nn->m_model.load(path);
-  if (err) {
-    Print("NNUGen: ERROR loading model %s\n", path);
-    return;
-  }
-  if (warmup > 0) {
+  if (nn->m_instance == nullptr)
+    nn->m_instance = gInstanceCache.take(nn->instanceKey());
+  if (nn->m_instance == nullptr) {
     if (nn->m_debug >= Debug::all)
-      Print("NNUGen: warming up model\n", path);
-    nn->warmupModel(warmup);
+      Print("NNUGen: loading model %s\n", path);
+    nn->m_instance = gInstanceCache.create(nn->instanceKey(), warmup);
+    if (nn->m_instance == nullptr) {
+      Print("NNUGen: ERROR loading model %s\n", path);
+      return;
+    }
+  }
+  for (auto& stage: nn->m_chain) {
+    if (stage.instance == nullptr) {
+      NNInstanceCache::Key key{stage.model, stage.method, nn->m_bufferSize, nn->m_batches};
+      stage.instance = gInstanceCache.take(key);
+      if (stage.instance == nullptr) stage.instance = gInstanceCache.create(key, warmup);
+      if (stage.instance == nullptr) {
+        Print("NNUGen: ERROR loading chained model %s\n", stage.model->getPath());
+        return;
+      }
+    }
+    // views on values the audio thread updates, read as they are when performing
+    int64_t dim = stage.method->inDim;
+    stage.scaleTensor = torch::from_blob(stage.scale, {1, dim, 1});
+    stage.offsetTensor = torch::from_blob(stage.offset, {1, dim, 1});
+  }
+  for (auto& attr: nn->m_attributes) {
+    if (!nn->m_instance->setters[attr.attrIdx].method)
+      Print("NNUGen: setter for attribute %s not found\n", attr.getName());
   }
+  if (nn->m_minSize < nn->m_bufferSize) nn->calibrate(warmup);
   nn->m_loaded = true;
   if (nn->m_debug >= Debug::all)
-    Print("NNUGen: loaded %s\n", path);
+    Print("NNUGen: loaded %s, warmed up in %d passes\n", path, nn->m_instance->warmupPasses);
 }
 
+// RT memory of an instance destroyed off the audio thread, in its storage:
+// the RT allocator isn't thread safe, the audio thread frees it (see freeRetired)
+struct NNRetired {
+  NNRetired* next;
+  void* memory[4];
+};
+static_assert(sizeof(NNRetired) <= sizeof(NN));
+static std::atomic<NNRetired*> gRetired = nullptr;
+
 void model_perform_cleanup(NN* nn_instance) {
-  auto mWorld = nn_instance->mWorld;
-  // manually call destructor and free instance
+  gStats.remove(&nn_instance->m_stats);
+  // reset and reused by the cache, or destroyed off the audio thread
+  if (nn_instance->m_instance) gInstanceCache.give(nn_instance->m_instance);
+  for (auto& stage: nn_instance->m_chain)
+    if (stage.instance) gInstanceCache.give(stage.instance);
+  void* memory[] = {nn_instance->m_inModel, nn_instance->m_outModel,
+                    nn_instance->m_chain.data(), nn_instance->m_chainValues};
+  // manually call destructor, the audio thread frees the instance
   nn_instance->~NN();
-  RTFree(mWorld, nn_instance);
+  auto retired = new(nn_instance) NNRetired{gRetired.load(std::memory_order_relaxed),
+                                            {memory[0], memory[1], memory[2], memory[3]}};
+  while (!gRetired.compare_exchange_weak(retired->next, retired, std::memory_order_release,
+                                         std::memory_order_relaxed)) {}
 }
 
-void model_perform(NN* nn_instance) {
-  /* Timer timer; */
-  std::vector<float *> in_model, out_model;
-  for (int c(0); c < nn_instance->m_inDim * nn_instance->m_batches; ++c)
-    in_model.push_back(&nn_instance->m_inModel[nn_instance->m_bufferSize * c]);
-  for (int c(0); c < nn_instance->m_outDim * nn_instance->m_batches; ++c)
-    out_model.push_back(&nn_instance->m_outModel[nn_instance->m_bufferSize * c]);
+// audio thread: free the RT memory of instances destroyed since last time
+static void freeRetired(World* world) {
+  if (gRetired.load(std::memory_order_relaxed) == nullptr) return;
+  auto retired = gRetired.exchange(nullptr, std::memory_order_acquire);
+  while (retired != nullptr) {
+    auto next = retired->next;
+    for (void* memory: retired->memory) RTFree(world, memory);
+    RTFree(world, retired);
+    retired = next;
+  }
+}
+
+// NRT thread: add an instance's stats to the model's, the registry locks and allocates
+static void model_perform_stats(NN* nn_instance) {
+  auto modelIdx = nn_instance->m_modelDesc->getId();
+  nn_instance->m_stats.setParent(gStats.model(modelIdx));
+  gStats.add(&nn_instance->m_stats, modelIdx, nn_instance->m_nodeId);
+}
+
+// NRT thread: register stats, and hand an instance over to the worker pool
+// or join a batch group, both lock and allocate
+static bool model_perform_register(World* world, void* data) {
+  auto nn_instance = static_cast<NN*>(data);
+  model_perform_stats(nn_instance);
+  if (nn_instance->m_sharedBatches > 0) {
+    gBatchScheduler.join(nn_instance, nn_instance->m_sharedBatches,
+                         nn_instance->m_gatherTimeout, nn_instance->m_warmup);
+    return false;
+  }
+  // adopt a warmed instance (see /nn_warmup): starts without loading anything.
+  // Chained instances and adaptive sizes are prepared by the worker pool
+  if (nn_instance->m_instance == nullptr)
+    nn_instance->m_instance = gInstanceCache.take(nn_instance->instanceKey());
+  if (nn_instance->m_instance && nn_instance->m_chain.empty()
+      && nn_instance->m_minSize == nn_instance->m_bufferSize)
+    nn_instance->m_loaded = true;
+  gWorkerPool.add(nn_instance);
+  return false;
+}
+
+// NRT thread: stop an instance's job, once registered (async commands run in order).
+// The pool can retire and free the job as soon as it's stopped: wake its worker by index
+static bool model_perform_stop(World* world, void* data) {
+  auto nn_instance = static_cast<NN*>(data);
+  if (auto group = nn_instance->m_batchGroup.load()) {
+    group->stop(nn_instance);
+    return false;
+  }
+  int worker = nn_instance->worker();
+  nn_instance->m_should_stop_perform_thread = true;
+  gWorkerPool.notifyWorker(worker);
+  return false;
+}
+
+// process a window, recording timings
+void model_perform(NN* nn_instance, float* in, float* out) {
+  auto& stats = nn_instance->m_stats;
+  auto start = NN::Clock::now();
   model_perform_attributes(nn_instance);
-  /* timer.print("attrs:"); */
-  nn_instance->m_model.perform(in_model, out_model,
-                               nn_instance->m_bufferSize,
-                               nn_instance->m_method->name, nn_instance->m_batches);
-  /* timer.print("perform:"); */
-}
-
-
-void model_perform_loop(NN *nn_instance, int warmup) {
-  model_perform_load(nn_instance, warmup);
-  std::vector<float *> in_model, out_model;
-  int numInputs = nn_instance->m_inDim * nn_instance->m_batches;
-  int numOutputs = nn_instance->m_outDim * nn_instance->m_batches;
-  for (int c(0); c < numInputs; ++c)
-    in_model.push_back(&nn_instance->m_inModel[nn_instance->m_bufferSize * c]);
-  for (int c(0); c < numOutputs; ++c)
-    out_model.push_back(&nn_instance->m_outModel[nn_instance->m_bufferSize * c]);
-  while (!nn_instance->m_should_stop_perform_thread) {
-    if (nn_instance->m_data_available_lock.try_acquire_for(
-      std::chrono::milliseconds(200))) {
-        /* nn_instance->timer.print("received in:"); */
-      model_perform_attributes(nn_instance);
-        /* Timer timer; */
-      nn_instance->m_model.perform(in_model, out_model,
-                                   nn_instance->m_bufferSize,
-                                   nn_instance->m_method->name, nn_instance->m_batches);
-        /* timer.print("model perform:"); */
-      nn_instance->m_result_available_lock.release();
-    }
+  auto attributesDone = NN::Clock::now();
+  nn_instance->perform(in, out);
+  stats.record(stageAttributes, attributesDone - start);
+  stats.record(nn_instance->m_timings);
+  stats.record(stageCompute, NN::Clock::now() - start);
+  stats.count(countWindows);
+}
+
+void NN::load() {
+  model_perform_load(this, m_warmup);
+}
+
+bool NN::run() {
+  // when stopped, still write windows submitted to server buffers
+  if (m_should_stop_perform_thread
+      && !(m_queue.hasPending() && m_bufWindows[m_queue.pendingInputSlot()].out.data))
+    return false;
+  if (m_queue.hasPending()) {
+    int bufferSize = m_windowSizes[m_queue.pendingInputSlot()];
+    auto start = Clock::now();
+    readBuffer(m_queue.pendingInput());
+    model_perform(this, m_queue.pendingInput(), m_queue.pendingOutput());
+    writeBuffer(m_queue.pendingOutput());
+    auto end = Clock::now();
+    if (end > m_queue.pendingDeadline()) m_stats.count(countMissed);
+    if (!m_adaptive.empty()) adapt(bufferSize, end - start);
+    m_queue.complete();
   }
-  model_perform_cleanup(nn_instance);
-  Debug("NN: thread exit\n");
+  return true;
+}
+
+void NN::retire() {
+  Debug("NN: retired\n");
+  model_perform_cleanup(this);
 }
 
 void NNUGen::next(int nSamples) {
 
+  freeRetired(mWorld);
   if (!m_sharedData->m_loaded) {
     ClearUnitOutputs(this, nSamples);
     return;
   };
+  if (!m_aligned) {
+    alignToServerClock();
+    m_aligned = true;
+  }
 
   // update attr setters
   for (auto& a: m_sharedData->m_attributes) a.update(this, nSamples);
+  updateChain();
+  m_sharedData->m_priority.store(static_cast<int>(in0(UGenInputs::priority)), std::memory_order_relaxed);
+
+  if (m_shed && mWorld->mBufCounter >= m_shedUntil)
+    restore();
+
+  // windows are counted in audio samples, also at control rate
+  int samples = nSamples * m_step;
+  if (m_outBufnum >= 0) {
+    // outputs are written to a server buffer by the compute thread
+    discardResults();
+    if (m_lastWindow) {
+      // done once the last window was written and its result released
+      if (m_sharedData->m_queue.inFlight() == 0) mDone = true;
+    } else if (!m_shed) {
+      writeInputs(samples);
+    }
+    ClearUnitOutputs(this, nSamples);
+    return;
+  }
+  if (!m_shed) writeInputs(samples);
+  writeOutputs(samples);
+}
 
+// copy inputs in place to the next queue slot, submitting it when full.
+// Only the samples the model takes are kept: the last of every inRatio.
+// Control rate inputs hold their value for the whole block
+void NNUGen::writeInputs(int nSamples) {
   int numInputs = m_inDim * m_batches;
+  int written = 0;
+  while (written < nSamples) {
+    if (m_adaptive && m_inPos == 0) resizeWindow();
+    int n = sc_min(nSamples - written, m_bufferSize - m_inPos);
+    float* inModel = m_sharedData->m_queue.nextInput();
+    // frames whose last sample is in [m_inPos, m_inPos + n)
+    int first = m_inPos / m_inRatio, last = (m_inPos + n) / m_inRatio;
+    int offset = written + m_inRatio - 1 - m_inPos;
+    // inputs read from a server buffer by the compute thread: only keep time
+    if (m_inBufnum >= 0) numInputs = 0;
+    for (int c(0); c < numInputs; ++c) {
+      int inputIdx = UGenInputs::inputs + c;
+      float* frames = &inModel[c * m_inFrames];
+      if (!isAudioRateIn(inputIdx)) {
+        std::fill(&frames[first], &frames[last], in0(inputIdx));
+      } else if (m_inRatio == 1) {
+        std::copy_n(in(inputIdx) + written, n, &frames[m_inPos]);
+      } else {
+        const float* inBuf = in(inputIdx) + offset;
+        for (int k = first; k < last; ++k) frames[k] = inBuf[k * m_inRatio];
+      }
+    }
+    m_inPos += n;
+    written += n;
+    if (m_inPos == m_bufferSize) {
+      m_inPos = 0;
+      submitWindow();
+    }
+  }
+}
+
+void NNUGen::writeOutputs(int nSamples) {
+  int available = readResults(nSamples);
+  // keep track of samples that were due before their window was computed
+  if (m_useThread && m_primed && !m_shed && available < nSamples) {
+    m_underrun += nSamples - available;
+    m_sharedData->m_stats.count(countUnderruns, nSamples - available);
+    m_windowLate = true;
+  }
+  if (!(m_overloadPolicy & (overloadHold | overloadShed))) return;
+  if (m_shed) available = 0;
+  if (available < nSamples || m_gain < 1.f)
+    fadeOutputs(available, nSamples);
+}
+
+void NNUGen::submitWindow() {
+  auto& queue = m_sharedData->m_queue;
+  if (!queue.canSubmit()) {
+    // all slots are still being computed: drop this window, refilling its slot
+    m_sharedData->m_stats.count(countDropped);
+    updateOverload(true);
+    return;
+  }
+  m_sharedData->m_windowSizes[queue.nextInputSlot()] = m_bufferSize;
+  setBufferWindow();
+  if (!m_useThread) {
+    // NO THREAD MODE: compute now, results are read like the worker's
+    queue.submit(NN::Clock::now());
+    m_sharedData->readBuffer(queue.pendingInput());
+    model_perform(m_sharedData, queue.pendingInput(), queue.pendingOutput());
+    m_sharedData->writeBuffer(queue.pendingOutput());
+    queue.complete();
+    return;
+  }
+  if (m_primed) updateOverload(false);
+  if (!m_primed) {
+    // output latency, see m_latency
+    m_preroll = (m_queueDepth - 1) * m_bufferSize;
+    m_primed = true;
+  }
+  // SIGNAL WORKERS THAT DATA IS AVAILABLE
+  auto latency = std::chrono::duration<double>(m_latency);
+  m_sharedData->submit(NN::Clock::now() + std::chrono::duration_cast<NN::Clock::duration>(latency));
+  m_sharedData->m_stats.queueDepth(queue.inFlight());
+}
+
+// the computed window being read, or nullptr if the next one isn't ready.
+// Skips samples that were already due, to keep latency constant
+float* NNUGen::nextResult() {
+  if (m_outWindow) return m_outWindow;
+  auto& queue = m_sharedData->m_queue;
+  // NRT: nothing is late, block until the window is computed
+  if (!mWorld->mRealTime && m_useThread && !queue.hasResult() && queue.inFlight() > 0)
+    queue.waitResult();
+  while (queue.hasResult()) {
+    float* outModel = queue.nextOutput();
+    m_outSize = m_sharedData->m_windowSizes[queue.resultInputSlot()];
+    m_outFrames = m_outSize / m_outRatio;
+    if (m_holdBuffer) {
+      std::copy_n(outModel, m_outDim * m_batches * m_outFrames, m_holdBuffer);
+      m_holdSize = m_outSize;
+      m_holdPos = 0;
+    }
+    int skip = sc_min(m_underrun, m_outSize);
+    m_underrun -= skip;
+    if (skip < m_outSize) {
+      m_outPos = skip;
+      m_outWindow = outModel;
+      return m_outWindow;
+    }
+    releaseWindow(outModel);
+  }
+  return nullptr;
+}
+
+// the window is done: keep its last frames for upsampling the next one,
+// and let its slot be computed again
+void NNUGen::releaseWindow(const float* outModel) {
+  if (m_history) {
+    for (int c(0); c < m_outDim * m_batches; ++c) {
+      float* history = &m_history[c * 3];
+      const float* frames = &outModel[c * m_outFrames];
+      float last[3];
+      for (int t = 0; t < 3; ++t)
+        last[t] = t < m_outFrames ? frames[m_outFrames - 1 - t] : history[t - m_outFrames];
+      std::copy_n(last, 3, history);
+    }
+  }
+  m_sharedData->m_queue.release();
+}
+
+// copy outputs in place from computed windows, zeros when none is ready.
+// At control rate, outputs take the value of the block's last sample.
+// Returns the number of samples that were available
+int NNUGen::readResults(int nSamples) {
   int numOutputs = m_outDim * m_batches;
+  bool control = m_step > 1;
+  int written = sc_min(nSamples, m_preroll);
+  for (int c(0); c < numOutputs; ++c) std::fill_n(out(c), control ? 1 : written, 0.f);
+  m_preroll -= written;
+  while (written < nSamples) {
+    float* outModel = nextResult();
+    if (outModel == nullptr) break;
+    int n = sc_min(nSamples - written, m_outSize - m_outPos);
+    if (!control || written + n == nSamples) {
+      int pos = control ? m_outPos + n - 1 : m_outPos;
+      int len = control ? 1 : n;
+      for (int c(0); c < numOutputs; ++c) {
+        const float* frames = &outModel[c * m_outFrames];
+        float* outBuf = control ? out(c) : out(c) + written;
+        if (m_outRatio == 1)
+          std::copy_n(&frames[pos], len, outBuf);
+        else
+          upsample(frames, m_history ? &m_history[c * 3] : nullptr, pos, len, outBuf);
+      }
+    }
+    m_outPos += n;
+    written += n;
+    if (m_outPos == m_outSize) {
+      releaseWindow(outModel);
+      m_outWindow = nullptr;
+      m_outPos = 0;
+    }
+  }
+  if (!control) {
+    for (int c(0); c < numOutputs; ++c)
+      std::fill_n(out(c) + written, nSamples - written, 0.f);
+  }
+  return written;
+}
+
+// SERVER BUFFERS
 
-  // copy inputs to circular buffer
-  for (int c(0); c < numInputs; ++c) {
-    m_inBuffer[c].put(in(UGenInputs::inputs + c), bufferSize());
+// bufnum if it's a buffer with the given number of channels, else -1
+int NNUGen::checkBuffer(int bufnum, int channels, const char* what) {
+  if (bufnum < 0) return -1;
+  if (static_cast<uint32_t>(bufnum) >= mWorld->mNumSndBufs || mWorld->mSndBufs[bufnum].data == nullptr) {
+    Print("NNUGen: %s buffer %d not found, using UGen %ss\n", what, bufnum, what);
+    return -1;
+  }
+  if (mWorld->mSndBufs[bufnum].channels != channels) {
+    Print("NNUGen: %s buffer %d needs %d channels, has %d, using UGen %ss\n",
+          what, bufnum, channels, mWorld->mSndBufs[bufnum].channels, what);
+    return -1;
   }
+  return bufnum;
+}
 
-  if (m_inBuffer[0].full()) {
+// frames of the next window in a buffer, advancing pos by a window
+NNBufferRange NNUGen::bufferRange(int bufnum, int frames, int64_t& pos) {
+  NNBufferRange range;
+  if (bufnum < 0) return range;
+  const SndBuf* buf = mWorld->mSndBufs + bufnum;
+  if (buf->data == nullptr || buf->frames == 0) return range;
+  if (m_bufLoop) pos %= buf->frames;
+  range.data = buf->data;
+  range.channels = buf->channels;
+  range.frames = buf->frames;
+  range.pos = static_cast<int>(sc_min(pos, static_cast<int64_t>(buf->frames)));
+  range.loop = m_bufLoop;
+  pos += frames;
+  return range;
+}
 
-    if (!m_useThread) {
+// resolve the next window's buffers, before submitting it.
+// Done when a one-shot output buffer is full
+void NNUGen::setBufferWindow() {
+  if (m_inBufnum < 0 && m_outBufnum < 0) return;
+  auto& window = m_sharedData->m_bufWindows[m_sharedData->m_queue.nextInputSlot()];
+  window.in = bufferRange(m_inBufnum, m_inFrames, m_inBufFrame);
+  window.out = bufferRange(m_outBufnum, m_bufferSize / m_outRatio, m_outBufFrame);
+  if (!m_bufLoop && window.out.data && m_outBufFrame >= window.out.frames)
+    m_lastWindow = true;
+}
 
-      for (int c(0); c < numInputs; ++c)
-        m_inBuffer[c].get(&m_inModel[c * m_bufferSize], m_bufferSize);
+// outputs go to a server buffer: results only free their slot
+void NNUGen::discardResults() {
+  auto& queue = m_sharedData->m_queue;
+  // NRT: nothing is late, keep a slot free for the next window
+  if (!mWorld->mRealTime) {
+    while (queue.inFlight() >= m_queueDepth) {
+      queue.waitResult();
+      queue.release();
+    }
+  }
+  while (queue.hasResult()) queue.release();
+}
 
-      model_perform(m_sharedData);
+void NN::readBuffer(float* in) const {
+  const auto& range = m_bufWindows[m_queue.pendingInputSlot()].in;
+  if (range.data == nullptr) return;
+  int frames = m_windowSizes[m_queue.pendingInputSlot()] / m_method->inRatio;
+  int numInputs = m_inDim * m_batches;
+  std::fill_n(in, numInputs * frames, 0.f);
+  // inputs are interlaced by dimension, like buffer channels
+  for (int k = 0; k < frames; ++k) {
+    int pos = range.loop ? (range.pos + k) % range.frames : range.pos + k;
+    if (pos >= range.frames) break;
+    const float* frame = &range.data[pos * range.channels];
+    for (int c = 0; c < numInputs; ++c) in[c * frames + k] = frame[c];
+  }
+}
+
+void NN::writeBuffer(const float* out) const {
+  const auto& range = m_bufWindows[m_queue.pendingInputSlot()].out;
+  if (range.data == nullptr) return;
+  int frames = m_windowSizes[m_queue.pendingInputSlot()] / m_outMethod->outRatio;
+  int numOutputs = m_outDim * m_batches;
+  for (int k = 0; k < frames; ++k) {
+    int pos = range.loop ? (range.pos + k) % range.frames : range.pos + k;
+    if (pos >= range.frames) break;
+    float* frame = &range.data[pos * range.channels];
+    for (int c = 0; c < numOutputs; ++c) frame[c] = out[c * frames + k];
+  }
+}
+
+// UPSAMPLING
+// frame k of an output window plays over samples [k * outRatio, (k + 1) * outRatio)
+
+// lanczos kernel with a = 2: a windowed sinc low-pass, 4 taps wide
+static float lanczos2(float x) {
+  constexpr float pi = 3.14159265358979f;
+  if (x == 0.f) return 1.f;
+  if (std::abs(x) >= 2.f) return 0.f;
+  float px = pi * x;
+  return 2.f * std::sin(px) * std::sin(px / 2.f) / (px * px);
+}
 
-      for (int c(0); c < numOutputs; ++c)
-        m_outBuffer[c].put(&m_outModel[c * m_bufferSize], m_bufferSize);
-    } else if (m_sharedData->m_result_available_lock.try_acquire()) {
-      /* Print("sending\n"); m_sharedData->timer.reset(); */
-      // TRANSFER MEMORY BETWEEN INPUT CIRCULAR BUFFER AND MODEL BUFFER
-      for (int c(0); c < numInputs; ++c)
-        m_inBuffer[c].get(&m_inModel[c * m_bufferSize], m_bufferSize);
-      // TRANSFER MEMORY BETWEEN OUTPUT CIRCULAR BUFFER AND MODEL BUFFER
-      for (int c(0); c < numOutputs; ++c)
-        m_outBuffer[c].put(&m_outModel[c * m_bufferSize], m_bufferSize);
-      // SIGNAL PERFORM THREAD THAT DATA IS AVAILABLE
-      m_sharedData->m_data_available_lock.release();
+// polyphase filter interpolating between frames k-2 and k-1 from frames k-3 to k:
+// coefficient of tap t for phase j at kernel[t * ratio + j], each phase normalized
+static void makeLowpassKernel(float* kernel, int ratio) {
+  for (int j = 0; j < ratio; ++j) {
+    float f = static_cast<float>(j + 1) / ratio;
+    float w[4], sum = 0.f;
+    for (int t = 0; t < 4; ++t) sum += w[t] = lanczos2(f + 1 - t);
+    for (int t = 0; t < 4; ++t) kernel[t * ratio + j] = w[t] / sum;
+  }
+}
+
+// write n samples of a channel from window position pos, upsampled from its frames.
+// history holds the previous window's last frames, most recent first
+void NNUGen::upsample(const float* frames, const float* history, int pos, int n, float* out) const {
+  int ratio = m_outRatio;
+  auto frame = [&](int k) { return k >= 0 ? frames[k] : history[-k - 1]; };
+  while (n > 0) {
+    int k = pos / ratio, j = pos % ratio;
+    int len = sc_min(n, ratio - j);
+    switch (m_interp) {
+      case interpLinear: {
+        float a = frame(k - 1), slope = (frames[k] - a) / ratio;
+        for (int i = 0; i < len; ++i) out[i] = a + slope * (j + i + 1);
+        break;
+      }
+      case interpLowpass: {
+        const float* c0 = &m_kernel[j];
+        const float* c1 = c0 + ratio;
+        const float* c2 = c1 + ratio;
+        const float* c3 = c2 + ratio;
+        float x0 = frame(k - 3), x1 = frame(k - 2), x2 = frame(k - 1), x3 = frames[k];
+        for (int i = 0; i < len; ++i)
+          out[i] = c0[i] * x0 + c1[i] * x1 + c2[i] * x2 + c3[i] * x3;
+        break;
+      }
+      default:
+        std::fill_n(out, len, frames[k]);
+    }
+    out += len;
+    pos += len;
+    n -= len;
+  }
+}
+
+// OVERLOAD
+
+// instances on the audio thread, newest first
+static NNUGen* sInstances = nullptr;
+
+// called once per window: detect sustained deadline misses
+void NNUGen::updateOverload(bool dropped) {
+  bool late = m_windowLate || dropped;
+  m_windowLate = false;
+  if (!late) {
+    m_lateWindows = 0;
+    return;
+  }
+  if (++m_lateWindows % m_missThreshold != 0) return;
+  if (m_lateWindows == m_missThreshold)
+    Print("NNUGen: %s can't keep up with real time (%d late windows)\n",
+          m_sharedData->m_modelDesc->getPath(), m_lateWindows);
+  // shed one more instance every missThreshold late windows
+  if (m_overloadPolicy & overloadShed) shedLowest();
+}
+
+// samples from available on were not computed in time:
+// fade out held or live output, fade back in when output is available again
+void NNUGen::fadeOutputs(int available, int nSamples) {
+  int numOutputs = m_outDim * m_batches;
+  int numValues = nSamples / m_step;
+  float step = static_cast<float>(m_step) / m_bufferSize;
+  float gain = m_gain;
+  int holdPos = m_holdPos;
+  for (int c(0); c < numOutputs; ++c) {
+    float* outBuf = out(c);
+    const float* holdBuf = m_holdBuffer ? &m_holdBuffer[c * (m_holdSize / m_outRatio)] : nullptr;
+    gain = m_gain;
+    holdPos = m_holdPos;
+    for (int i(0); i < numValues; ++i) {
+      if ((i + 1) * m_step <= available) {
+        gain = sc_min(1.f, gain + step);
+        outBuf[i] *= gain;
+      } else {
+        gain = sc_max(0.f, gain - step);
+        outBuf[i] = (holdBuf ? holdBuf[holdPos / m_outRatio] : outBuf[i]) * gain;
+        holdPos += m_step;
+        if (holdPos >= m_holdSize) holdPos -= m_holdSize;
+      }
     }
   }
+  m_gain = gain;
+  m_holdPos = holdPos;
+}
+
+// shed the lowest priority instance of this model, newest first
+void NNUGen::shedLowest() {
+  auto modelDesc = m_sharedData->m_modelDesc;
+  NNUGen* lowest = nullptr;
+  int lowestPriority = 0;
+  for (NNUGen* unit = sInstances; unit != nullptr; unit = unit->m_nextInstance) {
+    if (unit->m_shed || !unit->m_useThread || unit->m_sharedData->m_modelDesc != modelDesc)
+      continue;
+    int priority = unit->m_sharedData->m_priority.load(std::memory_order_relaxed);
+    if (lowest == nullptr || priority < lowestPriority) {
+      lowest = unit;
+      lowestPriority = priority;
+    }
+  }
+  if (lowest) lowest->shed();
+}
 
-  // copy circular buf to out
-  for (int c(0); c < numOutputs; ++c)
-    m_outBuffer[c].get(out(c), bufferSize());
+void NNUGen::shed() {
+  Print("NNUGen: overload, stopping an instance of %s (priority %d) for %d blocks\n",
+        m_sharedData->m_modelDesc->getPath(),
+        m_sharedData->m_priority.load(std::memory_order_relaxed), m_shedBlocks);
+  m_sharedData->m_stats.count(countShed);
+  m_shed = true;
+  m_shedUntil = mWorld->mBufCounter + m_shedBlocks;
+  m_lateWindows = 0;
+}
+
+// start processing again after being shed
+void NNUGen::restore() {
+  m_shed = false;
+  m_primed = false;
+  m_underrun = 0;
+  m_lateWindows = 0;
+  m_windowLate = false;
+  m_inPos = 0;
+  if (m_sharedData->m_sharedBatches > 0) alignToServerClock();
+}
+
+bool NNUGen::modelOverloaded(const NNModelDesc* modelDesc) {
+  for (NNUGen* unit = sInstances; unit != nullptr; unit = unit->m_nextInstance) {
+    if (unit->m_sharedData->m_modelDesc == modelDesc && unit->m_lateWindows >= unit->m_missThreshold)
+      return true;
+  }
+  return false;
+}
+
+void NN::submit(Clock::time_point deadline) {
+  m_queue.submit(deadline);
+  if (auto group = m_batchGroup.load(std::memory_order_acquire))
+    group->wake(deadline);
+  else
+    gWorkerPool.notify(this);
+}
+
+void NN::perform(float* in, float* out) {
+  auto* pending = &m_instance->prepared;
+  if (!m_adaptive.empty()) {
+    int bufferSize = m_windowSizes[m_queue.pendingInputSlot()];
+    for (auto& size: m_adaptive)
+      if (size.bufferSize == bufferSize) pending = &size.prepared;
+  }
+  auto& prepared = *pending;
+  if (m_chain.empty()) {
+    m_instance->model.perform(prepared, in, out);
+    m_timings = prepared.timings;
+    return;
+  }
+  c10::InferenceMode guard;
+  // intermediate outputs stay tensors, on the model's device
+  auto tensor = m_instance->model.perform_tensor(prepared, in);
+  for (auto& stage: m_chain) {
+    if (!tensor.defined()) break;
+    tensor = stage.instance->model.perform_tensor(
+      stage.instance->prepared, tensor.mul(stage.scaleTensor).add_(stage.offsetTensor));
+  }
+  auto last = m_chain.back().instance;
+  if (tensor.defined())
+    last->model.write_output(last->prepared, tensor, out);
+  m_timings = prepared.timings;
+  for (auto& stage: m_chain) {
+    const auto& timings = stage.instance->prepared.timings;
+    m_timings.input += timings.input;
+    m_timings.forward += timings.forward;
+    m_timings.output += timings.output;
+  }
 }
 
 NN::NN(
   World* world,
   const NNModelDesc* modelDesc, const NNModelMethod* modelMethod,
-  float* inModel, float* outModel,  
-  RingBuf* inRing, RingBuf* outRing,
-  int bufferSize, int debug, int batches): 
+  const NNModelMethod* outMethod, float* inModel, float* outModel,
+  int bufferSize, int debug, int batches, int queueDepth, int warmup): 
   mWorld(world),
   m_inModel(inModel), m_outModel(outModel),
-  m_inBuffer(inRing), m_outBuffer(outRing),
-  m_method(modelMethod), m_modelDesc(modelDesc), 
+  m_method(modelMethod), m_outMethod(outMethod), m_modelDesc(modelDesc), 
+  m_queue(queueDepth,
+          inModel, bufferSize / modelMethod->inRatio * modelMethod->inDim * batches,
+          outModel, bufferSize / outMethod->outRatio * outMethod->outDim * batches),
   m_bufferSize(bufferSize), m_debug(debug),
-  m_batches(batches),
-  m_compute_thread(nullptr),
-  m_data_available_lock(0), m_result_available_lock(1),
-  m_should_stop_perform_thread(false), m_loaded(false)
+  m_batches(batches), m_warmup(warmup), m_priority(0),
+  m_chainValues(nullptr),
+  m_instance(nullptr),
+  m_nodeId(0),
+  m_should_stop_perform_thread(false), m_loaded(false),
+  m_sharedBatches(0), m_gatherTimeout(0.0),
+  m_batchGroup(nullptr), m_performInline(false),
+  m_minSize(bufferSize), m_margin(0.f), m_sampleRate(0.0),
+  m_targetSize(bufferSize), m_load(1.0), m_fastWindows(0)
 {
   m_inDim = m_method->inDim;
-  m_outDim = m_method->outDim;
+  m_outDim = m_outMethod->outDim;
+  std::fill_n(m_windowSizes, SlotQueue::maxDepth + 1, bufferSize);
+}
+
+// ADAPTIVE BUFFER SIZE
+
+// smallest size computed within its margin at the given load, or the largest one
+int NN::smallestSize(double load) const {
+  for (const auto& size: m_adaptive) {
+    double budget = (1.0 - m_margin) * size.bufferSize / m_sampleRate;
+    if (size.calibrated * load <= budget) return size.bufferSize;
+  }
+  return m_adaptive.empty() ? m_bufferSize : m_adaptive.back().bufferSize;
+}
+
+// on the loader thread: prepare every size on the instance, and time a window
+// of each once warmed up. The first windows get the smallest size that fits
+void NN::calibrate(int n_passes) {
+  auto& model = m_instance->model;
+  std::vector<int> params{m_method->inDim, m_method->inRatio, m_method->outDim, m_method->outRatio};
+  auto jit = getJitSettings(m_modelDesc);
+  for (int bufferSize = m_minSize; bufferSize <= m_bufferSize; bufferSize *= 2) {
+    NNAdaptiveSize size{bufferSize};
+    if (!model.prepare(size.prepared, m_method->name, params, bufferSize, m_batches, true)) {
+      Print("NNUGen: ERROR preparing buffer size %d, not adapting\n", bufferSize);
+      m_adaptive.clear();
+      return;
+    }
+    model.warmup(size.prepared, jit, sc_max(1, n_passes));
+    const auto& timings = size.prepared.timings;
+    size.calibrated = std::chrono::duration<double>(timings.input + timings.forward + timings.output).count();
+    if (m_debug >= Debug::all)
+      Print("NNUGen: buffer size %d computed in %.2f ms\n", bufferSize, 1e3 * size.calibrated);
+    m_adaptive.push_back(std::move(size));
+  }
+  m_targetSize.store(smallestSize(m_load), std::memory_order_relaxed);
+}
+
+// on the compute thread, after each window: grow right away when windows of
+// this size get too slow, shrink one size at a time once smaller windows
+// would have been fast enough for a while
+void NN::adapt(int bufferSize, Clock::duration time) {
+  size_t k = 0;
+  while (k + 1 < m_adaptive.size() && m_adaptive[k].bufferSize < bufferSize) ++k;
+  double ratio = std::chrono::duration<double>(time).count() / m_adaptive[k].calibrated;
+  // a slow window counts right away, its effect halves in about 35 windows
+  m_load = sc_max(ratio, m_load * 0.98);
+  int target = smallestSize(m_load);
+  if (target > bufferSize) {
+    m_targetSize.store(target, std::memory_order_relaxed);
+    m_fastWindows = 0;
+  } else if (target < bufferSize && ++m_fastWindows >= adaptShrinkWindows) {
+    m_targetSize.store(bufferSize / 2, std::memory_order_relaxed);
+    m_fastWindows = 0;
+  } else if (target == bufferSize) {
+    m_fastWindows = 0;
+  }
 }
 
 
 NNUGen::NNUGen(): 
-  m_inBuffer(nullptr), m_outBuffer(nullptr)
+  m_sharedData(nullptr),
+  m_inModel(nullptr), m_outModel(nullptr),
+  m_inPos(0), m_outPos(0), m_outWindow(nullptr), m_preroll(0),
+  m_inBufnum(-1), m_outBufnum(-1), m_bufLoop(false), m_lastWindow(false),
+  m_inBufFrame(0), m_outBufFrame(0),
+  m_history(nullptr), m_kernel(nullptr),
+  m_primed(false), m_aligned(true), m_underrun(0),
+  m_lateWindows(0), m_windowLate(false),
+  m_shed(false), m_shedUntil(0),
+  m_holdBuffer(nullptr), m_holdSize(0), m_holdPos(0), m_gain(0.f),
+  m_prevInstance(nullptr), m_nextInstance(nullptr)
 {
   auto modelIdx = static_cast<unsigned short>(in0(UGenInputs::modelIdx));
   const NNModelDesc* modelDesc = gModels.get(modelIdx);
@@ -236,16 +925,33 @@ NNUGen::NNUGen():
     set_calc_function<NNUGen, &NNUGen::clearOutputs>();
     return;
   }
+  m_overloadPolicy = modelDesc->getOverloadPolicy();
+  m_missThreshold = modelDesc->getMissThreshold();
+  m_shedBlocks = static_cast<int>(modelDesc->getShedTime() * fullSampleRate() / fullBufferSize());
+  if ((m_overloadPolicy & overloadRefuse) && modelOverloaded(modelDesc)) {
+    Print("NNUGen: %s is overloaded, not starting a new instance\n", modelDesc->getPath());
+    set_calc_function<NNUGen, &NNUGen::clearOutputs>();
+    return;
+  }
   m_inDim = modelMethod->inDim;
-  m_outDim = modelMethod->outDim;
   m_batches = sc_max(1, static_cast<int>(in0(UGenInputs::n_batches)));
+  int modelHigherRatio = modelDesc->getHigherRatio();
+  // outputs are the last chained method's
+  m_chainLength = sc_max(0, static_cast<int>(in0(UGenInputs::chainLength)));
+  const NNModelMethod* outMethod = checkChain(modelMethod, modelHigherRatio);
+  if (outMethod == nullptr) {
+    Print("NNUGen: invalid method chain, disabling\n");
+    set_calc_function<NNUGen, &NNUGen::clearOutputs>();
+    return;
+  }
+  m_outDim = outMethod->outDim;
+  m_queueDepth = sc_min(16, sc_max(2, static_cast<int>(in0(UGenInputs::queueDepth))));
 
   m_bufferSize = in0(UGenInputs::bufSize);
   Debug("NNUGen: bufSize %d\n", m_bufferSize); 
 
-  // don't use external thread on NRT
+  // don't use external thread on NRT, unless processing large windows (see below)
   m_useThread = mWorld->mRealTime;
-  int modelHigherRatio = modelDesc->getHigherRatio();
   if (m_bufferSize < 0) {
     m_bufferSize = modelHigherRatio;
   } else if (m_bufferSize == 0) {
@@ -263,8 +969,50 @@ NNUGen::NNUGen():
     }
   }
 
-  if (bufferSize() > m_bufferSize) {
-    Print("NNUGen: blockSize(%d) larger than model bufferSize(%d), disabling\n", bufferSize(), m_bufferSize);
+  // NRT: large windows, processed on the worker pool while the graph goes on,
+  // so that independent UGens run in parallel. Adds one window of latency
+  float nrtWindow = gNrtWindow.load(std::memory_order_relaxed);
+  if (!mWorld->mRealTime && nrtWindow > 0) {
+    int modelBuffers = static_cast<int>(std::ceil(nrtWindow * fullSampleRate() / m_bufferSize));
+    m_bufferSize *= sc_max(1, modelBuffers);
+    m_queueDepth = 2;
+    m_useThread = true;
+  }
+
+  // control rate: each value stands for a whole block
+  m_step = calcRate() == calc_FullRate ? 1 : fullBufferSize();
+
+  // ADAPTIVE BUFFER SIZE: windows from the model's minimum to bufferSize,
+  // 8 times the minimum by default. Only with deadlines: RT, on computation threads
+  m_adaptive = in0(UGenInputs::adaptMargin) >= 0 && m_useThread && mWorld->mRealTime;
+  if (m_adaptive && m_chainLength > 0) {
+    Print("NNUGen: chained methods can't adapt their buffer size, using %d.\n", m_bufferSize);
+    m_adaptive = false;
+  }
+  int minSize = modelHigherRatio;
+  while (minSize < m_step * bufferSize()) minSize *= 2;
+  if (m_adaptive) {
+    int maxSize = in0(UGenInputs::bufSize) < 0 ? 8 * modelHigherRatio : m_bufferSize;
+    m_bufferSize = minSize;
+    while (m_bufferSize * 2 <= maxSize) m_bufferSize *= 2;
+    m_adaptive = m_bufferSize > minSize;
+  }
+  // buffers are allocated for the largest window
+  m_maxBufferSize = m_bufferSize;
+
+  m_inRatio = modelMethod->inRatio;
+  m_outRatio = outMethod->outRatio;
+  m_inFrames = m_bufferSize / m_inRatio;
+  m_outFrames = m_bufferSize / m_outRatio;
+  m_interp = sc_min(static_cast<int>(interpLowpass), sc_max(0, static_cast<int>(in0(UGenInputs::interp))));
+  m_inBufnum = checkBuffer(static_cast<int>(in0(UGenInputs::inBuf)), m_inDim * m_batches, "input");
+  m_outBufnum = checkBuffer(static_cast<int>(in0(UGenInputs::outBuf)), m_outDim * m_batches, "output");
+  m_bufLoop = in0(UGenInputs::bufLoop) > 0;
+  m_outSize = m_bufferSize;
+  m_holdSize = m_bufferSize;
+
+  if (m_step * bufferSize() > m_bufferSize) {
+    Print("NNUGen: blockSize(%d) larger than model bufferSize(%d), disabling\n", m_step * bufferSize(), m_bufferSize);
     set_calc_function<NNUGen, &NNUGen::clearOutputs>();
     return;
   }
@@ -276,6 +1024,10 @@ NNUGen::NNUGen():
   }
 
   m_debug = static_cast<int>(in0(UGenInputs::debug));
+  int warmup = static_cast<int>(in0(UGenInputs::warmup));
+  // output latency: one window is computed while the previous one plays,
+  // each additional slot gives computation one more window of time
+  m_latency = (m_queueDepth - 1) * m_bufferSize / fullSampleRate();
 
   void* data = RTAlloc(mWorld, sizeof(NN));
   if (!data) {
@@ -283,107 +1035,191 @@ NNUGen::NNUGen():
     ClearUnitOnMemFailed;
   }
   Debug("NNUGen: init sharedData\n");
-  m_sharedData = new(data) NN(mWorld, modelDesc, modelMethod, 
-                        m_inModel, m_outModel, m_inBuffer, m_outBuffer,
-                        m_bufferSize, m_debug, m_batches);
-
-  Debug("NNUGen: use thread %d\n", m_useThread);
-  int warmup = static_cast<int>(in0(UGenInputs::warmup));
-  if (m_useThread)
-    m_sharedData->m_compute_thread = new std::thread(model_perform_loop, m_sharedData, warmup);
-  else
-    model_perform_load(m_sharedData, warmup);
+  m_sharedData = new(data) NN(mWorld, modelDesc, modelMethod, outMethod,
+                        m_inModel, m_outModel,
+                        m_bufferSize, m_debug, m_batches, m_queueDepth, warmup);
+  // stats are registered on the NRT thread, see model_perform_register
+  m_sharedData->m_nodeId = mParent->mNode.mID;
+  m_sharedData->m_performInline = !m_useThread;
+  if (m_adaptive) {
+    m_sharedData->m_minSize = minSize;
+    m_sharedData->m_margin = sc_min(0.9f, in0(UGenInputs::adaptMargin));
+    m_sharedData->m_sampleRate = fullSampleRate();
+  }
 
   Debug("NNUGen: setupAttributes\n", m_useThread);
+  if (!setupChain()) {
+    m_sharedData->~NN();
+    RTFree(mWorld, m_sharedData);
+    m_sharedData = nullptr;
+    freeBuffers();
+    ClearUnitOnMemFailed;
+  }
   setupAttributes();
 
+  Debug("NNUGen: use thread %d\n", m_useThread);
+  m_sharedData->m_priority = static_cast<int>(in0(UGenInputs::priority));
+  int sharedBatches = static_cast<int>(in0(UGenInputs::sharedBatches));
+  if (sharedBatches > 0 && !m_sharedData->m_attributes.empty()) {
+    Print("NNUGen: attributes can't be set on a shared batch, using own model instance.\n");
+    sharedBatches = 0;
+  }
+  if (sharedBatches > 0 && m_adaptive) {
+    Print("NNUGen: adaptive buffer size can't run on a shared batch, using own model instance.\n");
+    sharedBatches = 0;
+  }
+  if (sharedBatches > 0 && m_chainLength > 0) {
+    Print("NNUGen: chained methods can't run on a shared batch, using own model instance.\n");
+    sharedBatches = 0;
+  }
+  if (!mWorld->mRealTime && sharedBatches > 0) {
+    // batches gather windows by wall clock time
+    Print("NNUGen: sharedBatches not supported on NRT, using own model instance.\n");
+    sharedBatches = 0;
+  }
+  if (m_useThread && sharedBatches > 0) {
+    // joins a group on the NRT thread, aligned once the group is loaded
+    m_sharedData->m_sharedBatches = sharedBatches;
+    // allow other UGens one control block to submit their windows to the batch
+    m_sharedData->m_gatherTimeout = fullBufferSize() / fullSampleRate();
+    m_aligned = false;
+    DoAsynchronousCommand(mWorld, nullptr, "", m_sharedData,
+                          model_perform_register, nullptr, nullptr, nullptr, 0, nullptr);
+  } else {
+    // warmed instances are adopted off the audio thread, by the registration stage
+    // or when loading
+    if (!mWorld->mRealTime) {
+      // NRT: no deadline, load before the first block is rendered
+      if (!m_useThread) model_perform_stats(m_sharedData);
+      model_perform_load(m_sharedData, warmup);
+    }
+    if (m_useThread || mWorld->mRealTime) {
+      // in no thread mode too: never load on the audio thread
+      if (mWorld->mRealTime)
+        DoAsynchronousCommand(mWorld, nullptr, "", m_sharedData,
+                              model_perform_register, nullptr, nullptr, nullptr, 0, nullptr);
+      else
+        model_perform_register(mWorld, m_sharedData);
+    }
+  }
+
+  m_nextInstance = sInstances;
+  if (sInstances) sInstances->m_prevInstance = this;
+  sInstances = this;
+
   mCalcFunc = make_calc_function<NNUGen, &NNUGen::next>();
   if (m_debug >= Debug::all)
   Debug("NNUGen: Ctor done\n");
 }
 
+// adaptive buffer size: before filling a window, switch to the size
+// the compute thread picked (see NN::adapt), and report it to clients as
+// [/nn_buffer_size, nodeID, UGen index, bufferSize, latency]
+void NNUGen::resizeWindow() {
+  int size = sc_min(m_maxBufferSize, m_sharedData->m_targetSize.load(std::memory_order_relaxed));
+  if (size == m_bufferSize && m_primed) return;
+  if (m_primed) {
+    // keep queueDepth - 1 windows of latency: play silence when growing,
+    // skip samples when shrinking
+    int diff = (m_queueDepth - 1) * (size - m_bufferSize);
+    if (diff > 0) m_preroll += diff;
+    else m_underrun -= diff;
+  }
+  m_bufferSize = size;
+  m_inFrames = size / m_inRatio;
+  m_latency = (m_queueDepth - 1) * m_bufferSize / fullSampleRate();
+  float reply[2] = {static_cast<float>(m_bufferSize), static_cast<float>(m_latency)};
+  SendNodeReply(&mParent->mNode, static_cast<int>(mParentIndex), "/nn_buffer_size", 2, reply);
+  if (m_debug >= Debug::all)
+    Print("NNUGen: buffer size %d, latency %.1f ms\n", m_bufferSize, 1e3 * m_latency);
+}
+
+// batch groups process their members together: fill windows when
+// the server's sample count is a multiple of bufferSize, so that all members
+// of a group submit them on the same audio block
+void NNUGen::alignToServerClock() {
+  int offset = static_cast<int>((mWorld->mBufCounter * static_cast<int64_t>(m_step * bufferSize())) % m_bufferSize);
+  float* inModel = m_sharedData->m_queue.nextInput();
+  for (int c(0); c < m_inDim * m_batches; ++c)
+    std::fill_n(&inModel[c * m_inFrames], offset / m_inRatio, 0.f);
+  m_inPos = offset;
+}
+
 NNUGen::~NNUGen() {
   Debug("NN: Dtor\n");
-  if (m_sharedData->m_compute_thread) {
-    // don't wait for join, it would stall the dsp chain
-    // thread frees resources when stopped
-    m_sharedData->m_should_stop_perform_thread = true;
-    /* m_compute_thread->join(); */
+  // constructor failed before creating the instance
+  if (m_sharedData == nullptr) return;
+  if (m_prevInstance) m_prevInstance->m_nextInstance = m_nextInstance;
+  else if (sInstances == this) sInstances = m_nextInstance;
+  if (m_nextInstance) m_nextInstance->m_prevInstance = m_prevInstance;
+  RTFree(mWorld, m_holdBuffer);
+  RTFree(mWorld, m_history);
+  RTFree(mWorld, m_kernel);
+
+  if (m_useThread || mWorld->mRealTime) {
+    // don't wait for the worker, it would stall the dsp chain:
+    // the pool retires the job, or the batch group its member, and frees resources when stopped
+    if (mWorld->mRealTime)
+      DoAsynchronousCommand(mWorld, nullptr, "", m_sharedData,
+                            model_perform_stop, nullptr, nullptr, nullptr, 0, nullptr);
+    else
+      model_perform_stop(mWorld, m_sharedData);
   } else {
     Debug("NN: freeing manually\n");
-    m_sharedData->~NN(); // this frees resources
-    RTFree(mWorld, m_sharedData);
+    model_perform_cleanup(m_sharedData);
+    freeRetired(mWorld);
   }
 }
 
 // BUFFERS
 
-RingBuf* allocRingBuffer(World* world, size_t bufSize, size_t numChannels) {
-  RingBuf* ctrs = rtAlloc<RingBuf>(world, numChannels);
-  float* data = rtAlloc<float>(world, numChannels * bufSize);
-  if (ctrs == nullptr || data == nullptr) {
-    RTFree(world, ctrs); return nullptr;
-  };
-  memset(data, 0, sizeof(float) * numChannels * bufSize);
-  for (int c(0); c < numChannels; ++c) {
-    auto buf = data + (bufSize * c);
-    new(ctrs + c) RingBuf(buf, bufSize);
-  };
-  /* Print("ctrs: %p\ndata: %p\n", ctrs, data); */
-  return ctrs;
-}
-
-void freeRingBuffer(World* world, RingBuf* buf) {
-  if (buf == nullptr) return;
-  RTFree(world, buf[0].getBuffer()); // data
-  RTFree(world, buf);
-}
-
 bool NNUGen::allocBuffers() {
   int numInputs = m_inDim * m_batches;
   int numOutputs = m_outDim * m_batches;
-  m_inBuffer = allocRingBuffer(mWorld, m_bufferSize, numInputs);
-  if (m_inBuffer == nullptr) return false;
-  m_outBuffer = allocRingBuffer(mWorld, m_bufferSize, numOutputs);
-  if (m_outBuffer == nullptr) return false;
-  m_inModel = rtAlloc<float>(mWorld, m_bufferSize * numInputs);
+  // one model buffer per queue slot, see SlotQueue
+  int inSize = m_inFrames * numInputs * (m_queueDepth + 1);
+  int outSize = m_outFrames * numOutputs * m_queueDepth;
+  m_inModel = rtAlloc<float>(mWorld, inSize);
   if(m_inModel == nullptr) return false;
-  m_outModel = rtAlloc<float>(mWorld, m_bufferSize * numOutputs);
+  m_outModel = rtAlloc<float>(mWorld, outSize);
   if(m_outModel == nullptr) return false;
-  memset(m_inModel, 0, sizeof(float) * m_bufferSize * numInputs);
-  memset(m_outModel, 0, sizeof(float) * m_bufferSize * numOutputs);
+  memset(m_inModel, 0, sizeof(float) * inSize);
+  memset(m_outModel, 0, sizeof(float) * outSize);
+  if (m_overloadPolicy & overloadHold) {
+    m_holdBuffer = rtAlloc<float>(mWorld, m_outFrames * numOutputs);
+    if (m_holdBuffer == nullptr) return false;
+    memset(m_holdBuffer, 0, sizeof(float) * m_outFrames * numOutputs);
+  }
+  if (m_outRatio > 1 && m_interp != interpHold) {
+    m_history = rtAlloc<float>(mWorld, 3 * numOutputs);
+    if (m_history == nullptr) return false;
+    memset(m_history, 0, sizeof(float) * 3 * numOutputs);
+  }
+  if (m_outRatio > 1 && m_interp == interpLowpass) {
+    m_kernel = rtAlloc<float>(mWorld, 4 * m_outRatio);
+    if (m_kernel == nullptr) return false;
+    makeLowpassKernel(m_kernel, m_outRatio);
+  }
   /* Print("m_inModel: %p\nm_outModel: %p\n", m_inModel, m_outModel); */
   return true;
 }
 
 void NNUGen::freeBuffers() {
   /* Print("NN: freeing buffers\n"); */
-  freeRingBuffer(mWorld, m_inBuffer);
-  freeRingBuffer(mWorld, m_outBuffer);
   RTFree(mWorld, m_inModel);
   RTFree(mWorld, m_outModel);
+  RTFree(mWorld, m_holdBuffer);
+  RTFree(mWorld, m_history);
+  RTFree(mWorld, m_kernel);
+  m_holdBuffer = nullptr;
+  m_history = nullptr;
+  m_kernel = nullptr;
   /* RTFree(mWorld, m_model); */
 }
 
+// RT memory is freed by the audio thread, see model_perform_cleanup
 NN::~NN() {
-  freeRingBuffer(mWorld, m_inBuffer);
-  freeRingBuffer(mWorld, m_outBuffer);
-  RTFree(mWorld, m_inModel);
-  RTFree(mWorld, m_outModel);
-  if (m_compute_thread) { free(m_compute_thread); }
-}
-
-void NN::warmupModel(int n_passes=1) {
-  /* Timer timer; */
-  std::vector<float *> in_model, out_model;
-  for (int c(0); c < m_inDim; ++c)
-    in_model.push_back(&m_inModel[m_bufferSize * c]);
-  for (int c(0); c < m_outDim; ++c)
-    out_model.push_back(&m_outModel[m_bufferSize * c]);
-
-  for(int i=0; i < n_passes; ++i)
-    m_model.perform(in_model, out_model, m_bufferSize, m_method->name, 1);
-  /* timer.print("warmup:"); */
+  for (auto& stage: m_chain) stage.~NNChainStage();
 }
 
 } // namespace NN
@@ -392,6 +1228,7 @@ void NN::warmupModel(int n_passes=1) {
 PluginLoad(NNUGens) {
   // Plugin magic
   ft = inTable;
+  gModelPool.setCacheDir(gModels.getCacheDir());
 
   registerUnit<NN::NNUGen>(ft, "NNUGen", false);
   NN::Cmd::definePlugInCmds();
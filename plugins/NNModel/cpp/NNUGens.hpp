@@ -2,57 +2,54 @@
 
 #pragma once
 #include "NNModel.hpp"
+#include "NNBatchGroup.hpp"
+#include "NNInstanceCache.hpp"
+#include "NNStats.hpp"
+#include "NNWorkerPool.hpp"
 #include "backend/backend.h"
 #include "SC_PlugIn.hpp"
-#include "rt_circular_buffer.h"
+#include "rt_slot_queue.h"
+#include <atomic>
 #include <chrono>
-#include <semaphore>
+#include <span>
 #include <string>
-#include <thread>
 
 namespace NN {
 
-using RingBuf = RingBufCtrl<float, float>;
-
 enum Debug { none=0, attributes=1, all=2 };
 
-/* class Timer { */
-/*   std::chrono::high_resolution_clock::time_point start; */
-/* public: */ 
-/*   Timer() { reset(); } */
-
-/*   void reset() { */
-/*     start = std::chrono::high_resolution_clock::now(); */
-/*   } */
-/*   void print(const char* label) { */
-/*     auto now = std::chrono::high_resolution_clock::now(); */
-/*     std::cout << label */
-/*       << std::chrono::duration_cast<std::chrono::milliseconds>(now - start) */
-/*       << std::endl; */
-/*   } */
-/* }; */
+// how output frames of methods with outRatio > 1 are upsampled
+enum Interp {
+  interpHold=0,
+  // ramp from the previous frame
+  interpLinear=1,
+  // polyphase windowed sinc, delays outputs by one more frame
+  interpLowpass=2
+};
 
 class NNSetAttr {
 public:
   const NNModelAttribute* attr;
+  // index in the model, selects the instance's setter
+  int attrIdx;
   // remember in0 indices
   int inputIdx;
 
-  NNSetAttr(const NNModelAttribute* attr, int inputIdx, float initVal);
+  NNSetAttr(const NNModelAttribute* attr, int attrIdx, int inputIdx, float initVal);
 
   // called in audio thread: check trig, update value and flag
   void update(Unit* unit, int nSamples);
 
   const char* getName() const { return attr->name.c_str(); }
   bool changed() const { return valUpdated; }
-  // called before model_perform
-  std::string getStrValue() {
+  // called before model_perform: value typed for the setter
+  c10::IValue getValue() {
     valUpdated = false;
     if (attr->type == NNAttributeType::typeBool)
-      return value > 0 ? "true" : "false";
+      return value > 0;
     else if (attr->type == NNAttributeType::typeInt)
-      return std::to_string(static_cast<int>(value));
-    return std::to_string(value);
+      return static_cast<int64_t>(value);
+    return static_cast<double>(value);
   }
 
 private:
@@ -61,35 +58,147 @@ private:
   bool valUpdated = false;
 };
 
-class NN {
+// frames of a window in a server buffer, read or written by the compute thread.
+// Resolved by the UGen when submitting the window: the buffer must not be
+// reallocated while the UGen plays
+struct NNBufferRange {
+  // nullptr: the window is read from the UGen's inputs or written to its outputs
+  float* data = nullptr;
+  int channels = 0;
+  int frames = 0;
+  // buffer frame of the window's first frame
+  int pos = 0;
+  bool loop = false;
+};
+
+struct NNBufferWindow {
+  NNBufferRange in, out;
+};
+
+// a buffer size an adaptive UGen can switch to, see NN::adapt
+struct NNAdaptiveSize {
+  int bufferSize;
+  PreparedMethod prepared;
+  // seconds a window took once warmed up, when loading
+  double calibrated;
+};
+
+// a method performed on the previous method's output tensor in the same window,
+// e.g. decode after encode: latents don't go through UGen outputs and inputs
+struct NNChainStage {
+  const NNModelDesc* model;
+  const NNModelMethod* method;
+  // first in0 index of scales, followed by offsets, by input dimension
+  int inputIdx;
+  // applied to the previous output: x * scale + offset, by input dimension.
+  // Updated on the audio thread, read when performing, like attributes.
+  // In RT memory with the stages, see NNUGen::setupChain
+  float* scale;
+  float* offset;
+  // wrapping scale and offset as [1, dim, 1], created when loading
+  at::Tensor scaleTensor, offsetTensor;
+  NNModelInstance* instance = nullptr;
+};
+
+class NN : public NNComputeJob {
 public:
+  // outMethod: the last chained method, or modelMethod
   NN(World* world, const NNModelDesc* modelDesc, const NNModelMethod* modelMethod,
-     float* inModel, float* outModel,  RingBuf* m_inBuffer, RingBuf* m_outBuffer,
-     int bufferSize, int m_debug, int batches);
+     const NNModelMethod* outMethod, float* inModel, float* outModel,
+     int bufferSize, int m_debug, int batches, int queueDepth, int warmup);
 
   ~NN();
 
-  void warmupModel(int n_passes);
+  // NNComputeJob: process one window at a time on the worker pool
+  void load() override;
+  bool loaded() const override { return m_loaded; }
+  bool ready() const override {
+    return m_should_stop_perform_thread || (!m_performInline && m_queue.hasPending());
+  }
+  Clock::time_point deadline() const override { return m_queue.pendingDeadline(); }
+  int priority() const override { return m_priority.load(std::memory_order_relaxed); }
+  int intraOpThreads() const override { return m_modelDesc->getIntraOpThreads(); }
+  bool run() override;
+  void retire() override;
+
+  NNInstanceCache::Key instanceKey() const { return {m_modelDesc, m_method, m_bufferSize, m_batches}; }
+  // process a window: in and out are [channel][frames] blocks, at model rate
+  void perform(float* in, float* out);
+  // adaptive buffer size: time every size when loading, and pick the next
+  // windows' size from the time the last one took
+  void calibrate(int n_passes);
+  void adapt(int bufferSize, Clock::duration time);
+  int smallestSize(double load) const;
+  // called on audio thread when the next queue slot is filled,
+  // deadline is when its output will be needed
+  void submit(Clock::time_point deadline);
+  // on the compute thread, around processing the pending window:
+  // copy its frames from and to server buffers, if any
+  void readBuffer(float* in) const;
+  void writeBuffer(const float* out) const;
 
-  RingBuf* m_inBuffer;
-  RingBuf* m_outBuffer;
+  // queue slots memory: UGens fill and read windows in place
   float* m_inModel;
   float* m_outModel;
   const NNModelDesc* m_modelDesc;
   const NNModelMethod* m_method;
+  const NNModelMethod* m_outMethod;
   World* mWorld;
-  std::thread* m_compute_thread;
-  std::binary_semaphore m_data_available_lock, m_result_available_lock;
+  SlotQueue m_queue;
   int m_inDim, m_outDim;
   int m_bufferSize, m_debug;
   int m_batches;
+  int m_warmup;
+  std::atomic<int> m_priority;
   std::vector<NNSetAttr> m_attributes;
-  Backend m_model;
-  bool m_should_stop_perform_thread;
-  bool m_loaded;
-  /* Timer timer; */
+  // methods performed after m_method in each window, see NNChainStage.
+  // Stages and their scales and offsets are RT memory, freed by the audio
+  // thread once the instance is destroyed
+  std::span<NNChainStage> m_chain;
+  float* m_chainValues;
+  // adopted from the instance cache or loaded, given back when done
+  NNModelInstance* m_instance;
+  // also recorded to the model's stats, once registered
+  NNStats m_stats;
+  // of the UGen's synth, to list stats by node
+  int m_nodeId;
+  // of the last window, summed over chained methods
+  PerformTimings m_timings;
+  std::atomic<bool> m_should_stop_perform_thread;
+  // set on the loader thread, read on the audio thread
+  std::atomic<bool> m_loaded;
+  // > 0: processed by a shared batch instead of as a job of its own,
+  // see model_perform_register
+  int m_sharedBatches;
+  double m_gatherTimeout;
+  // set on the NRT thread when joining a batch group, read on the audio thread
+  std::atomic<NNBatchGroup*> m_batchGroup;
+  // no thread mode: windows are computed on the audio thread, the pool only loads
+  bool m_performInline;
+  // by input slot of the queue
+  NNBufferWindow m_bufWindows[SlotQueue::maxDepth + 1];
+  // samples of each window, by input slot: up to m_bufferSize when adaptive
+  int m_windowSizes[SlotQueue::maxDepth + 1];
+
+  // adaptive buffer size, set by the UGen before loading:
+  // sizes from m_minSize to m_bufferSize, computed within (1 - m_margin) of their duration
+  int m_minSize;
+  float m_margin;
+  double m_sampleRate;
+  // set on the compute thread, applied by the UGen to its next window
+  std::atomic<int> m_targetSize;
+  // by size, empty when not adaptive
+  std::vector<NNAdaptiveSize> m_adaptive;
+  // how much slower than calibrated windows are computed, a decaying peak
+  double m_load;
+  // windows in a row that could have been computed at a smaller size
+  int m_fastWindows;
 };
 
+// destroy an NN instance, once its processing is stopped. Its RT memory is
+// freed later by the audio thread: any thread can clean up
+void model_perform_cleanup(NN* nn_instance);
+
 class NNUGen : public SCUnit {
 public:
 
@@ -99,23 +208,108 @@ public:
   void next(int nSamples);
   void freeBuffers();
   void setupAttributes();
+  bool setupChain();
 
   NN* m_sharedData;
 
 private:
-  enum UGenInputs { modelIdx=0, methodIdx, bufSize, warmup, debug, n_batches, inputs };
+  enum UGenInputs { modelIdx=0, methodIdx, bufSize, warmup, debug, n_batches, sharedBatches, queueDepth, priority, interp, inBuf, outBuf, bufLoop, chainLength, adaptMargin, inputs };
   void clearOutputs(int nSamples);
   bool allocBuffers();
+  void alignToServerClock();
+  void resizeWindow();
   void updateAttributes();
+  const NNModelMethod* checkChain(const NNModelMethod* method, int& higherRatio);
+  void updateChain();
+  void writeInputs(int nSamples);
+  void submitWindow();
+  float* nextResult();
+  int readResults(int nSamples);
+  void upsample(const float* frames, const float* history, int pos, int n, float* out) const;
+  void releaseWindow(const float* outModel);
+  // server buffers
+  int checkBuffer(int bufnum, int channels, const char* what);
+  NNBufferRange bufferRange(int bufnum, int frames, int64_t& pos);
+  void setBufferWindow();
+  void discardResults();
+  void writeOutputs(int nSamples);
+  // overload policy
+  void updateOverload(bool dropped);
+  void fadeOutputs(int available, int nSamples);
+  void shedLowest();
+  void shed();
+  void restore();
+  static bool modelOverloaded(const NNModelDesc* modelDesc);
 
-  RingBuf* m_inBuffer;
-  RingBuf* m_outBuffer;
   float* m_inModel;
   float* m_outModel;
+  // all channels of a window share positions: samples filled in the next
+  // input slot, and read from the output window being played
+  int m_inPos;
+  int m_outPos;
+  float* m_outWindow;
+  // zeros to play before the first result, see m_latency
+  int m_preroll;
   int m_inDim, m_outDim;
   int m_bufferSize, m_debug;
   int m_batches;
+  int m_queueDepth;
+  // chained methods, and first in0 index of attributes after their inputs
+  int m_chainLength;
+  int m_attrInput;
+  // windows only hold the frames the model takes and returns:
+  // the last sample of every inRatio, one frame per outRatio
+  int m_inRatio, m_outRatio;
+  // frames of the window being filled and of the one being read:
+  // with an adaptive buffer size, windows in flight can have different sizes
+  int m_inFrames, m_outFrames;
+  int m_outSize;
+  int m_interp;
+  // audio samples per output value: 1, or a whole block at control rate
+  int m_step;
+  // windows read from and written to server buffers instead of inputs and outputs,
+  // -1: none. Positions in buffer frames of the next submitted window
+  int m_inBufnum, m_outBufnum;
+  bool m_bufLoop;
+  // not looping: the window reaching the end of the output buffer was submitted,
+  // done once its result is released
+  bool m_lastWindow;
+  int64_t m_inBufFrame, m_outBufFrame;
+  // last frames of the previous window by output channel, most recent first
+  float* m_history;
+  // interpLowpass coefficients, see makeLowpassKernel
+  float* m_kernel;
+  // time to compute a window before its output is due
+  double m_latency;
   bool m_useThread;
+  // window size follows NN::m_targetSize, up to the size buffers were allocated for
+  bool m_adaptive;
+  int m_maxBufferSize;
+  // output latency was prerolled on first submitted window
+  bool m_primed;
+  // shared batches: windows were aligned to the server clock once loaded
+  bool m_aligned;
+  // output samples that were due but not computed yet
+  int m_underrun;
+
+  // overload policy, read from the model when created
+  int m_overloadPolicy;
+  int m_missThreshold;
+  int m_shedBlocks;
+  // consecutive windows that were late or dropped
+  int m_lateWindows;
+  bool m_windowLate;
+  // not processing until server block m_shedUntil
+  bool m_shed;
+  int64_t m_shedUntil;
+  // last received window, repeated on underruns with overloadHold
+  float* m_holdBuffer;
+  int m_holdSize;
+  int m_holdPos;
+  float m_gain;
+  // all instances, only accessed on the audio thread
+  NNUGen* m_prevInstance;
+  NNUGen* m_nextInstance;
 };
 
 } // namespace NN
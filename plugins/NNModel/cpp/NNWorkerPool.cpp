@@ -0,0 +1,227 @@
+#include "NNWorkerPool.hpp"
+#include "backend/backend.h"
+#include <algorithm>
+#include <limits>
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace NN {
+
+// how long an idle worker spins before sleeping, waiting for a window
+static constexpr auto workerSpinTime = std::chrono::microseconds(50);
+
+// true if a should run before b
+static bool moreUrgent(int aPriority, NNComputeJob::Clock::time_point aDeadline,
+                       int bPriority, NNComputeJob::Clock::time_point bDeadline) {
+  if (aPriority != bPriority) return aPriority > bPriority;
+  return aDeadline < bDeadline;
+}
+
+// set affinity and scheduling of a pool thread
+static bool applySettings(std::thread& thread, const NNPoolSettings& settings) {
+  bool ok = true;
+#if defined(__linux__)
+  if (!settings.cpus.empty()) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu: settings.cpus)
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus);
+    ok &= pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) == 0;
+  }
+#else
+  // no core affinity on this platform
+  ok &= settings.cpus.empty();
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+  sched_param param{};
+  int policy = SCHED_OTHER;
+  if (settings.policy != schedOther) {
+    policy = settings.policy == schedFifo ? SCHED_FIFO : SCHED_RR;
+    param.sched_priority = std::clamp(settings.priority,
+      sched_get_priority_min(policy), sched_get_priority_max(policy));
+  }
+  ok &= pthread_setschedparam(thread.native_handle(), policy, &param) == 0;
+#else
+  ok &= settings.policy == schedOther;
+#endif
+  return ok;
+}
+
+NNWorkerPool::~NNWorkerPool() {
+  m_quit = true;
+  {
+    std::lock_guard<std::mutex> lock(m_loadMutex);
+    m_loadCond.notify_all();
+  }
+  if (m_loader.joinable()) m_loader.join();
+  for (auto& worker: m_workers) {
+    worker->wake.notify();
+    if (worker->thread.joinable()) worker->thread.join();
+  }
+}
+
+void NNWorkerPool::start() {
+  std::call_once(m_started, &NNWorkerPool::startThreads, this);
+}
+
+void NNWorkerPool::startThreads() {
+  std::lock_guard<std::mutex> lock(m_settingsMutex);
+  // leave a core to the audio thread
+  int numWorkers = m_settings.numWorkers > 0 ? m_settings.numWorkers
+    : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+  for (int i = 0; i < numWorkers; ++i)
+    m_workers.push_back(std::make_unique<Worker>());
+  for (auto& worker: m_workers) {
+    worker->thread = std::thread(&NNWorkerPool::workerLoop, this, worker.get());
+    applySettings(worker->thread, m_settings);
+  }
+  m_loader = std::thread(&NNWorkerPool::loaderLoop, this);
+  applySettings(m_loader, m_settings);
+  m_running.store(true, std::memory_order_release);
+}
+
+bool NNWorkerPool::configure(const NNPoolSettings& settings) {
+  std::lock_guard<std::mutex> lock(m_settingsMutex);
+  m_settings = settings;
+  m_intraOpThreads = settings.intraOpThreads;
+  if (!m_running) return true;
+  bool ok = settings.numWorkers <= 0 || settings.numWorkers == numWorkers();
+  for (auto& worker: m_workers)
+    ok &= applySettings(worker->thread, settings);
+  ok &= applySettings(m_loader, settings);
+  return ok;
+}
+
+void NNWorkerPool::add(NNComputeJob* job) {
+  start();
+  int workerIdx = m_nextWorker.fetch_add(1, std::memory_order_relaxed) % numWorkers();
+  job->m_worker.store(workerIdx, std::memory_order_release);
+  {
+    auto& worker = m_workers[workerIdx];
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->jobs.push_back(job);
+  }
+  if (job->loaded()) {
+    job->m_loadDone.store(true, std::memory_order_release);
+    // stopped before it was added
+    notifyWorker(workerIdx);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_loadMutex);
+  m_loadQueue.push_back(job);
+  m_loadCond.notify_one();
+}
+
+void NNWorkerPool::notify(NNComputeJob* job) {
+  if (!job->m_loadDone.load(std::memory_order_acquire)) return;
+  notifyWorker(job->worker());
+}
+
+void NNWorkerPool::notifyWorker(int worker) {
+  if (worker < 0 || !m_running.load(std::memory_order_acquire)) return;
+  // prefer the job's own worker, or any idle one that can steal it
+  auto& home = m_workers[worker];
+  if (home->busy.load(std::memory_order_relaxed)) {
+    for (auto& other: m_workers) {
+      if (!other->busy.load(std::memory_order_relaxed)) {
+        other->wake.notify();
+        return;
+      }
+    }
+  }
+  home->wake.notify();
+}
+
+int NNWorkerPool::threadsFor(const NNComputeJob* job) const {
+  int n = job->intraOpThreads();
+  return n > 0 ? n : intraOpThreads();
+}
+
+void NNWorkerPool::loaderLoop() {
+  while (true) {
+    NNComputeJob* job;
+    {
+      std::unique_lock<std::mutex> lock(m_loadMutex);
+      m_loadCond.wait(lock, [this] { return m_quit || !m_loadQueue.empty(); });
+      if (m_quit) return;
+      job = m_loadQueue.front();
+      m_loadQueue.pop_front();
+    }
+    Backend::set_intra_op_threads(threadsFor(job));
+    job->load();
+    // once loaded, a stopped job can be retired and freed: don't touch it afterwards
+    int worker = job->worker();
+    job->m_loadDone.store(true, std::memory_order_release);
+    // windows submitted while loading, or stopped while loading
+    notifyWorker(worker);
+  }
+}
+
+NNComputeJob* NNWorkerPool::claim(Worker* worker, bool wait) {
+  std::unique_lock<std::mutex> lock(worker->mutex, std::defer_lock);
+  if (wait) lock.lock();
+  else if (!lock.try_lock()) return nullptr;
+
+  // earliest deadline first among ready jobs not running elsewhere
+  while (true) {
+    NNComputeJob* best = nullptr;
+    int bestPriority = 0;
+    auto bestDeadline = NNComputeJob::Clock::time_point::max();
+    for (auto job: worker->jobs) {
+      if (!job->m_loadDone.load(std::memory_order_acquire)
+          || job->m_claimed.load(std::memory_order_relaxed)
+          || !job->ready())
+        continue;
+      int priority = job->priority();
+      auto deadline = job->deadline();
+      if (best == nullptr || moreUrgent(priority, deadline, bestPriority, bestDeadline)) {
+        best = job;
+        bestPriority = priority;
+        bestDeadline = deadline;
+      }
+    }
+    if (best == nullptr) return nullptr;
+    // another worker could have claimed it meanwhile: look again
+    if (!best->m_claimed.exchange(true, std::memory_order_acquire)) return best;
+  }
+}
+
+NNComputeJob* NNWorkerPool::steal(Worker* thief) {
+  for (auto& worker: m_workers) {
+    if (worker.get() == thief) continue;
+    if (auto job = claim(worker.get(), false)) return job;
+  }
+  return nullptr;
+}
+
+void NNWorkerPool::remove(NNComputeJob* job) {
+  auto& worker = m_workers[job->worker()];
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  std::erase(worker->jobs, job);
+}
+
+void NNWorkerPool::workerLoop(Worker* worker) {
+  while (!m_quit) {
+    auto epoch = worker->wake.epoch();
+    NNComputeJob* job = claim(worker, true);
+    if (job == nullptr) job = steal(worker);
+    if (job == nullptr) {
+      worker->wake.wait(epoch, workerSpinTime);
+      continue;
+    }
+    worker->busy.store(true, std::memory_order_relaxed);
+    Backend::set_intra_op_threads(threadsFor(job));
+    bool alive = job->run();
+    worker->busy.store(false, std::memory_order_relaxed);
+    if (alive) {
+      job->m_claimed.store(false, std::memory_order_release);
+    } else {
+      remove(job);
+      job->retire();
+    }
+  }
+}
+
+} // namespace NN
@@ -0,0 +1,127 @@
+// NNWorkerPool.hpp
+
+#pragma once
+#include "rt_slot_queue.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NN {
+
+// work scheduled on the worker pool, e.g. a model instance processing windows
+class NNComputeJob {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  virtual ~NNComputeJob() = default;
+
+  // called once on the pool's loader thread, before the job can run
+  virtual void load() = 0;
+  // true if there's nothing to load: the job can run without waiting for the loader
+  virtual bool loaded() const { return false; }
+  // called by workers: true if there is something to run
+  virtual bool ready() const = 0;
+  // when ready: by when should run be done
+  virtual Clock::time_point deadline() const = 0;
+  // jobs with higher priority run first, then earliest deadline first
+  virtual int priority() const { return 0; }
+  // libtorch intra-op threads to run with, 0: pool default
+  virtual int intraOpThreads() const { return 0; }
+  // process one unit of work. Return false when the job is finished
+  virtual bool run() = 0;
+  // called after a finished job is removed from the pool
+  virtual void retire() = 0;
+
+  // the worker the job is assigned to, -1 until added to the pool.
+  // Read it before stopping a job: a stopped job can be retired and freed
+  // at any time, see NNWorkerPool::notifyWorker
+  int worker() const { return m_worker.load(std::memory_order_acquire); }
+
+private:
+  friend class NNWorkerPool;
+  std::atomic<bool> m_loadDone = false;
+  std::atomic<bool> m_claimed = false;
+  std::atomic<int> m_worker = -1;
+};
+
+enum NNSchedPolicy { schedOther=0, schedFifo, schedRR };
+
+struct NNPoolSettings {
+  // 0: one less than hardware threads. Only applies before the pool starts
+  int numWorkers = 0;
+  // cores workers run on, empty: any
+  std::vector<int> cpus;
+  // real-time scheduling, with priority for schedFifo and schedRR
+  NNSchedPolicy policy = schedOther;
+  int priority = 0;
+  // intra-op threads for models that don't set theirs, 0: libtorch default
+  int intraOpThreads = 0;
+};
+
+// fixed-size pool of compute threads shared by all UGens.
+// Each job is assigned to a worker, which runs its ready jobs
+// earliest-deadline-first: idle workers steal ready jobs from busy ones.
+// Loading jobs happens on a separate thread, so that it doesn't delay others
+class NNWorkerPool {
+public:
+  ~NNWorkerPool();
+
+  // create worker and loader threads, if not done yet.
+  // Called by commands on the NRT thread, never on the audio thread
+  void start();
+  // register a job: it's loaded in the background if needed, then scheduled on workers.
+  // Locks and allocates: not on the audio thread, see model_perform_register
+  void add(NNComputeJob* job);
+  // wake a worker to run job. Lock-free, can be called on audio thread
+  void notify(NNComputeJob* job);
+  // wake worker, or an idle one that can steal its jobs. Lock-free, doesn't
+  // touch any job: to be called after stopping one. Ignores worker -1
+  void notifyWorker(int worker);
+  int numWorkers() const { return static_cast<int>(m_workers.size()); }
+
+  // apply settings to workers and loader, now if they're running.
+  // Returns false if a setting couldn't be applied, e.g. for lack of permissions
+  bool configure(const NNPoolSettings& settings);
+  int intraOpThreads() const { return m_intraOpThreads.load(std::memory_order_relaxed); }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::vector<NNComputeJob*> jobs;
+    HybridEvent wake;
+    std::atomic<bool> busy = false;
+    std::thread thread;
+  };
+
+  void startThreads();
+  void workerLoop(Worker* worker);
+  void loaderLoop();
+  // claim the most urgent ready job among worker's ones
+  NNComputeJob* claim(Worker* worker, bool wait);
+  NNComputeJob* steal(Worker* thief);
+  void remove(NNComputeJob* job);
+  int threadsFor(const NNComputeJob* job) const;
+
+  std::mutex m_settingsMutex;
+  NNPoolSettings m_settings;
+  // set once workers are created, m_workers doesn't change afterwards
+  std::atomic<bool> m_running = false;
+  std::atomic<int> m_intraOpThreads = 0;
+
+  std::once_flag m_started;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::atomic<int> m_nextWorker = 0;
+  std::atomic<bool> m_quit = false;
+
+  std::mutex m_loadMutex;
+  std::condition_variable m_loadCond;
+  std::deque<NNComputeJob*> m_loadQueue;
+  std::thread m_loader;
+};
+
+} // namespace NN
@@ -1,84 +1,278 @@
 #include "backend.h"
 #include "parsing_utils.h"
 #include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <stdlib.h>
+#include <thread>
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <torch/csrc/jit/ir/constants.h>
+#include <torch/csrc/jit/ir/ir.h>
+#include <torch/csrc/jit/passes/dead_code_elimination.h>
+#include <torch/csrc/jit/runtime/graph_executor.h>
+#include <torch/csrc/jit/runtime/profiling_graph_executor_impl.h>
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(_WIN32)
+#include <process.h>
+#endif
 
 #define CPU torch::kCPU
 #define CUDA torch::kCUDA
 #define MPS torch::kMPS
 
-Backend::Backend() : m_loaded(0), m_device(CPU), m_use_gpu(false) {
+Backend::Backend()
+    : m_loaded(0), m_device(CPU), m_use_gpu(false),
+      m_precision(Precision::fp32) {
   at::init_num_threads();
 }
 
-void Backend::perform(std::vector<float *> in_buffer,
-                      std::vector<float *> out_buffer, int n_vec,
+void Backend::perform(const float *in_buffer, float *out_buffer, int n_vec,
                       std::string method, int n_batches) {
+  PreparedMethod prepared;
+  if (!prepare(prepared, method, get_method_params(method), n_vec, n_batches))
+    return;
+  std::unique_lock<std::mutex> model_lock(m_model_mutex);
+  perform(prepared, in_buffer, out_buffer);
+}
+
+bool Backend::prepare(PreparedMethod &prepared, std::string method,
+                      const std::vector<int> &params, int n_vec,
+                      int n_batches, bool decimated) {
   c10::InferenceMode guard;
+  if (!m_loaded || params.size() < 4)
+    return false;
+  try {
+    std::unique_lock<std::mutex> model_lock(m_model_mutex);
+    prepared.method = m_model.get_method(method);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return false;
+  }
+  prepared.in_dim = params[0];
+  prepared.in_ratio = params[1];
+  prepared.out_dim = params[2];
+  prepared.out_ratio = params[3];
+  prepared.n_vec = n_vec;
+  prepared.n_batches = n_batches;
+  prepared.decimated = decimated;
+  prepared.in_tensor =
+      torch::zeros({n_batches, prepared.in_dim, n_vec / prepared.in_ratio},
+                   at::TensorOptions().device(m_device).dtype(
+                       m_precision == Precision::bf16 ? torch::kBFloat16
+                                                      : torch::kFloat));
+  return true;
+}
 
-  auto params = get_method_params(method);
-  if (!params.size())
-    return;
+void Backend::perform(PreparedMethod &prepared, const float *in_buffer,
+                      float *out_buffer) {
+  c10::InferenceMode guard;
+  auto tensor_out = perform_tensor(prepared, in_buffer);
+  if (tensor_out.defined())
+    write_output(prepared, tensor_out, out_buffer);
+}
 
-  auto in_dim = params[0];
-  auto in_ratio = params[1];
-  auto out_dim = params[2];
-  auto out_ratio = params[3];
+at::Tensor Backend::perform_tensor(PreparedMethod &prepared,
+                                   const float *in_buffer) {
+  c10::InferenceMode guard;
 
-  if (!m_loaded)
-    return;
+  if (!m_loaded || !prepared.method)
+    return {};
 
-  // COPY BUFFER INTO A TENSOR
-  std::vector<at::Tensor> tensor_in;
-  for (auto buf : in_buffer)
-    tensor_in.push_back(torch::from_blob(buf, {1, 1, n_vec}));
+  auto n_vec = prepared.n_vec;
+  auto n_batches = prepared.n_batches;
+  auto in_dim = prepared.in_dim;
+  auto in_ratio = prepared.in_ratio;
+  auto &timings = prepared.timings;
+  timings = {};
+  auto start = std::chrono::steady_clock::now();
 
-  auto cat_tensor_in = torch::cat(tensor_in, 1);
-  cat_tensor_in = cat_tensor_in.reshape({in_dim, n_batches, -1, in_ratio});
-  cat_tensor_in = cat_tensor_in.select(-1, -1);
-  cat_tensor_in = cat_tensor_in.permute({1, 0, 2});
+  // WRAP BUFFER IN A TENSOR, WITHOUT COPYING
+  // channels are interlaced (dim * n_batches + batch), and the model only
+  // takes the last sample every in_ratio, unless already decimated
+  auto tensor_in =
+      prepared.decimated
+          ? torch::from_blob(const_cast<float *>(in_buffer),
+                             {in_dim, n_batches, n_vec / in_ratio})
+                .permute({1, 0, 2})
+          : torch::from_blob(const_cast<float *>(in_buffer),
+                             {in_dim, n_batches, n_vec / in_ratio, in_ratio})
+                .select(-1, -1)
+                .permute({1, 0, 2});
 
-  // SEND TENSOR TO DEVICE
-  std::unique_lock<std::mutex> model_lock(m_model_mutex);
-  cat_tensor_in = cat_tensor_in.to(m_device);
-  std::vector<torch::jit::IValue> inputs = {cat_tensor_in};
+  // COPY TO PREALLOCATED TENSOR ON DEVICE, CONVERTING TO MODEL PRECISION
+  prepared.in_tensor.copy_(tensor_in);
+  timings.input = std::chrono::steady_clock::now() - start;
+  return forward(prepared);
+}
+
+at::Tensor Backend::perform_tensor(PreparedMethod &prepared,
+                                   const at::Tensor &in) {
+  c10::InferenceMode guard;
 
-  // PROCESS TENSOR
+  if (!m_loaded || !prepared.method)
+    return {};
+  auto &timings = prepared.timings;
+  timings = {};
+  auto start = std::chrono::steady_clock::now();
+  if (in.sizes() != prepared.in_tensor.sizes()) {
+    std::cout << "chained method input shape is not consistent, expected "
+              << prepared.in_dim << " channels of "
+              << prepared.in_tensor.size(2) << " frames!\n";
+    return {};
+  }
+  // previous method's output, on device: converting to model precision
+  prepared.in_tensor.copy_(in);
+  timings.input = std::chrono::steady_clock::now() - start;
+  return forward(prepared);
+}
+
+namespace {
+// libtorch's jit settings are global: warmups hold them exclusively while
+// setting their model's (see JitSettingsGuard). Methods are optimized with
+// the settings in effect during their first calls, which warmups make on the
+// loader thread, so that compute threads never wait for settings
+std::mutex jit_settings_mutex;
+// profiling call(s), then the call optimizing the graph
+constexpr int jit_optimized_calls = 3;
+} // namespace
+
+at::Tensor Backend::forward(PreparedMethod &prepared) {
+  auto start = std::chrono::steady_clock::now();
   at::Tensor tensor_out;
   try {
-    tensor_out = m_model.get_method(method)(inputs).toTensor();
-    tensor_out = tensor_out.repeat_interleave(out_ratio).reshape(
-        {n_batches, out_dim, -1});
+    tensor_out = (*prepared.method)({prepared.in_tensor}).toTensor();
   } catch (const std::exception &e) {
     std::cerr << e.what() << '\n';
-    return;
+    return {};
   }
-  model_lock.unlock();
+  prepared.timings.forward = std::chrono::steady_clock::now() - start;
+  return tensor_out;
+}
 
-  int out_batches(tensor_out.size(0)), out_channels(tensor_out.size(1)),
-      out_n_vec(tensor_out.size(2));
+bool Backend::write_output(PreparedMethod &prepared, const at::Tensor &out,
+                           float *out_buffer) {
+  c10::InferenceMode guard;
+  auto n_vec = prepared.n_vec;
+  auto n_batches = prepared.n_batches;
+  auto out_dim = prepared.out_dim;
+  auto out_ratio = prepared.out_ratio;
+  auto start = std::chrono::steady_clock::now();
 
   // CHECKS ON TENSOR SHAPE
-  if (out_batches * out_channels != out_buffer.size()) {
-    std::cout << "bad out_buffer size, expected " << out_batches * out_channels
-              << " buffers, got " << out_buffer.size() << "!\n";
-    return;
+  if (out.dim() != 3 || out.size(0) != n_batches || out.size(1) != out_dim) {
+    std::cout << "bad model output shape, expected " << n_batches * out_dim
+              << " channels!\n";
+    return false;
   }
 
-  if (out_n_vec != n_vec) {
+  if (out.size(2) * out_ratio != n_vec) {
     std::cout << "model output size is not consistent, expected " << n_vec
-              << " samples, got " << out_n_vec << "!\n";
-    return;
+              << " samples, got " << out.size(2) * out_ratio << "!\n";
+    return false;
+  }
+
+  // COPY TO OUTPUT BUFFER, REPEATING EACH VALUE out_ratio TIMES
+  // unless decimated. Channels are grouped by batch (batch * out_dim + dim)
+  if (prepared.decimated) {
+    torch::from_blob(out_buffer, {n_batches, out_dim, n_vec / out_ratio})
+        .copy_(out);
+  } else {
+    auto out_shape = std::vector<int64_t>{n_batches, out_dim,
+                                          n_vec / out_ratio, out_ratio};
+    torch::from_blob(out_buffer, out_shape)
+        .copy_(out.unsqueeze(-1).expand(out_shape));
+  }
+  prepared.timings.output = std::chrono::steady_clock::now() - start;
+  return true;
+}
+
+// WARMUP
+
+namespace {
+// sets libtorch's global jit settings, restored when going out of scope.
+// One at a time, so that settings only apply to the model warming up
+class JitSettingsGuard {
+public:
+  explicit JitSettingsGuard(const JitSettings &settings)
+      : m_lock(jit_settings_mutex),
+        m_executor_mode(torch::jit::getExecutorMode().load()),
+        m_profiling_mode(torch::jit::getProfilingMode().load()),
+        m_fusion(torch::jit::getFusionStrategy()) {
+    if (settings.profiling >= 0) {
+      torch::jit::getExecutorMode() = settings.profiling != 0;
+      torch::jit::getProfilingMode() = settings.profiling != 0;
+    }
+    if (settings.fusion >= 0 || settings.bailout_depth >= 0) {
+      auto behavior = m_fusion.empty() ? torch::jit::FusionBehavior::STATIC
+                                       : m_fusion.front().first;
+      if (settings.fusion >= 0)
+        behavior = settings.fusion ? torch::jit::FusionBehavior::DYNAMIC
+                                   : torch::jit::FusionBehavior::STATIC;
+      size_t depth = settings.bailout_depth >= 0
+                         ? settings.bailout_depth
+                         : torch::jit::getBailoutDepth();
+      torch::jit::FusionStrategy strategy{{behavior, depth}};
+      torch::jit::setFusionStrategy(strategy);
+    }
   }
 
-  tensor_out = tensor_out.to(CPU);
-  tensor_out = tensor_out.reshape({out_batches * out_channels, -1});
-  auto out_ptr = tensor_out.contiguous().data_ptr<float>();
+  ~JitSettingsGuard() {
+    torch::jit::getExecutorMode() = m_executor_mode;
+    torch::jit::getProfilingMode() = m_profiling_mode;
+    torch::jit::setFusionStrategy(m_fusion);
+  }
+
+private:
+  std::lock_guard<std::mutex> m_lock;
+  bool m_executor_mode, m_profiling_mode;
+  torch::jit::FusionStrategy m_fusion;
+};
+} // namespace
+
+int Backend::warmup(PreparedMethod &prepared, const JitSettings &jit,
+                    int min_passes, int max_passes) {
+  bool has_settings =
+      jit.profiling >= 0 || jit.fusion >= 0 || jit.bailout_depth >= 0;
+  if (min_passes <= 0 && !has_settings)
+    return 0;
+  // the calls optimizing the graph always happen here, with the settings
+  min_passes = std::max(min_passes, jit_optimized_calls);
+  // stable: this many calls in a row within tolerance of the fastest one
+  constexpr int stable_passes = 3;
+  constexpr double tolerance = 1.2;
 
-  for (int i(0); i < out_buffer.size(); i++) {
-    memcpy(out_buffer[i], out_ptr + i * n_vec, n_vec * sizeof(float));
+  JitSettingsGuard guard(jit);
+  std::vector<float> in(prepared.in_dim * prepared.n_batches *
+                        prepared.in_frames());
+  std::vector<float> out(prepared.out_dim * prepared.n_batches *
+                         prepared.out_frames());
+  auto best = std::chrono::steady_clock::duration::max();
+  int stable = 0, passes = 0;
+  while (passes < std::max(min_passes, max_passes)) {
+    perform(prepared, in.data(), out.data());
+    passes++;
+    const auto &t = prepared.timings;
+    auto time = t.input + t.forward + t.output;
+    if (time * tolerance < best)
+      stable = 1; // much faster than before: still warming up
+    else if (time < best * tolerance)
+      stable++;
+    else
+      stable = 0;
+    best = std::min(best, time);
+    if (passes >= min_passes && stable >= stable_passes)
+      break;
   }
+  return passes;
 }
 
 int Backend::load(std::string path) {
@@ -89,6 +283,573 @@ int Backend::load(std::string path) {
 
     std::unique_lock<std::mutex> model_lock(m_model_mutex);
     m_model = model;
+    m_shared = nullptr;
+    m_precision = Precision::fp32;
+    m_loaded = 1;
+    model_lock.unlock();
+
+    m_available_methods = get_available_methods();
+    m_path = path;
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+}
+
+std::shared_ptr<const torch::jit::script::Module>
+Backend::load_module(std::string path, c10::DeviceType device) {
+  try {
+    auto model =
+        std::make_shared<torch::jit::script::Module>(torch::jit::load(path));
+    model->eval();
+    model->to(device);
+    return model;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+// model file version, to invalidate stale weights and converted modules
+namespace {
+struct ModelStamp {
+  uint64_t size = 0;
+  int64_t mtime = 0;
+};
+} // namespace
+
+static bool get_stamp(const std::string &path, ModelStamp &stamp) {
+  std::error_code ec;
+  stamp.size = std::filesystem::file_size(path, ec);
+  if (!ec)
+    stamp.mtime =
+        std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+  return !ec;
+}
+
+// WEIGHTS MAPPING
+#if defined(__linux__) || defined(__APPLE__)
+// weights file: a header, then each parameter's data, page aligned
+//   magic, model size, model mtime, number of parameters
+//   per parameter: name length, name, dtype, number of bytes, offset
+
+static constexpr char weights_magic[8] = {'n', 'n', 'a', 'r', 'w', 't', 's', '1'};
+static constexpr uint64_t weights_align = 4096;
+
+namespace {
+struct WeightsEntry {
+  std::string name;
+  int64_t dtype;
+  uint64_t nbytes, offset;
+};
+
+} // namespace
+
+template <class T> static void write_pod(std::ostream &stream, T value) {
+  stream.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+template <class T> static bool read_pod(const char *&data, const char *end, T &value) {
+  if (end - data < static_cast<ptrdiff_t>(sizeof(T)))
+    return false;
+  std::memcpy(&value, data, sizeof(T));
+  data += sizeof(T);
+  return true;
+}
+
+static bool write_weights(const torch::jit::script::Module &module,
+                          const std::string &weights_file, ModelStamp stamp) {
+  std::vector<std::pair<std::string, at::Tensor>> params;
+  for (const auto &p : module.named_parameters(true))
+    params.push_back({p.name, p.value.contiguous()});
+
+  // header size first, to place data after it
+  uint64_t header = sizeof(weights_magic) + 3 * sizeof(uint64_t);
+  for (const auto &[name, tensor] : params)
+    header += sizeof(uint64_t) + name.size() + sizeof(int64_t) + 2 * sizeof(uint64_t);
+  std::vector<WeightsEntry> entries;
+  uint64_t offset = header;
+  for (const auto &[name, tensor] : params) {
+    offset = (offset + weights_align - 1) / weights_align * weights_align;
+    uint64_t nbytes = tensor.numel() * tensor.element_size();
+    entries.push_back({name, static_cast<int64_t>(tensor.scalar_type()), nbytes, offset});
+    offset += nbytes;
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(std::filesystem::path(weights_file).parent_path(), ec);
+  // write aside and rename: other processes never map a partial file
+  auto tmp_file = weights_file + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream file(tmp_file, std::ios::binary);
+    if (!file.is_open())
+      return false;
+    file.write(weights_magic, sizeof(weights_magic));
+    write_pod<uint64_t>(file, stamp.size);
+    write_pod<int64_t>(file, stamp.mtime);
+    write_pod<uint64_t>(file, entries.size());
+    for (const auto &e : entries) {
+      write_pod<uint64_t>(file, e.name.size());
+      file.write(e.name.data(), e.name.size());
+      write_pod<int64_t>(file, e.dtype);
+      write_pod<uint64_t>(file, e.nbytes);
+      write_pod<uint64_t>(file, e.offset);
+    }
+    for (size_t i = 0; i < params.size(); ++i) {
+      file.seekp(entries[i].offset);
+      file.write(static_cast<const char *>(params[i].second.data_ptr()), entries[i].nbytes);
+    }
+    if (!file.good())
+      return false;
+  }
+  std::filesystem::rename(tmp_file, weights_file, ec);
+  if (ec)
+    std::filesystem::remove(tmp_file, ec);
+  return !ec;
+}
+
+// rebind module parameters to a mapped weights file.
+// Returns false if the file is missing, stale or doesn't match the module
+static bool map_weights(torch::jit::script::Module &module,
+                        const std::string &weights_file, ModelStamp stamp,
+                        bool huge_pages) {
+  int fd = open(weights_file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  // private: pages are shared until written, a write only copies that page
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  std::shared_ptr<void> mapping(addr, [size](void *p) { munmap(p, size); });
+
+  const char *data = static_cast<const char *>(addr);
+  const char *end = data + size;
+  char magic[sizeof(weights_magic)];
+  uint64_t model_size, count;
+  int64_t model_mtime;
+  if (!read_pod(data, end, magic) ||
+      std::memcmp(magic, weights_magic, sizeof(magic)) != 0 ||
+      !read_pod(data, end, model_size) || !read_pod(data, end, model_mtime) ||
+      !read_pod(data, end, count) || model_size != stamp.size ||
+      model_mtime != stamp.mtime)
+    return false;
+  std::map<std::string, WeightsEntry> entries;
+  for (uint64_t i = 0; i < count; ++i) {
+    WeightsEntry e;
+    uint64_t name_size;
+    if (!read_pod(data, end, name_size) || end - data < static_cast<ptrdiff_t>(name_size))
+      return false;
+    e.name.assign(data, name_size);
+    data += name_size;
+    if (!read_pod(data, end, e.dtype) || !read_pod(data, end, e.nbytes) ||
+        !read_pod(data, end, e.offset) || e.offset + e.nbytes > size)
+      return false;
+    entries[e.name] = e;
+  }
+
+  // check everything before rebinding anything
+  auto params = module.named_parameters(true);
+  std::vector<std::pair<at::Tensor, const WeightsEntry *>> bindings;
+  for (const auto &p : params) {
+    auto it = entries.find(p.name);
+    if (it == entries.end() ||
+        it->second.dtype != static_cast<int64_t>(p.value.scalar_type()) ||
+        it->second.nbytes != p.value.numel() * p.value.element_size())
+      return false;
+    bindings.push_back({p.value, &it->second});
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  // page cache pages of a file mapping mostly can't be huge: copy the
+  // weights to anonymous memory advised before it's touched, private to
+  // this process
+  if (huge_pages) {
+    void *copy = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy != MAP_FAILED) {
+      madvise(copy, size, MADV_HUGEPAGE);
+      std::memcpy(copy, addr, size);
+      addr = copy;
+      mapping.reset(copy, [size](void *p) { munmap(p, size); });
+    }
+  }
+#endif
+  torch::NoGradGuard no_grad;
+  for (auto &[param, entry] : bindings) {
+    auto mapped = torch::from_blob(
+        static_cast<char *>(addr) + entry->offset, param.sizes(),
+        [mapping](void *) {}, param.options());
+    param.set_data(mapped);
+  }
+  return true;
+}
+#endif
+
+// clone a module sharing its parameters, but not its buffers and other
+// attributes, which hold per-instance state (e.g. cached convolutions padding)
+static torch::jit::script::Module
+clone_context(const torch::jit::script::Module &module) {
+  auto context = module.clone(true);
+  c10::IValue::HashIdentityIValueMap memo;
+  for (const auto &submodule : context.modules()) {
+    auto type = submodule.type();
+    auto object = submodule._ivalue();
+    for (size_t i = 0; i < type->numAttributes(); i++) {
+      if (type->is_parameter(i) || type->getAttribute(i)->is_module())
+        continue;
+      object->setSlot(i, object->getSlot(i).deepcopy(memo));
+    }
+  }
+  return context;
+}
+
+// PRECISION CONVERSION
+
+static const char *precision_name(Precision precision) {
+  switch (precision) {
+  case Precision::bf16:
+    return "bf16";
+  case Precision::int8:
+    return "int8";
+  default:
+    return "fp32";
+  }
+}
+
+// processing methods the model exports
+static std::vector<std::string>
+exported_methods(const torch::jit::script::Module &module) {
+  Backend backend;
+  backend.load(std::make_shared<const torch::jit::script::Module>(module), "");
+  return backend.get_available_methods();
+}
+
+// methods and attributes the plugin calls, kept by freezing
+static std::vector<std::string>
+preserved_attributes(const torch::jit::script::Module &module) {
+  Backend backend;
+  backend.load(std::make_shared<const torch::jit::script::Module>(module), "");
+  std::vector<std::string> names{"get_methods", "get_attributes"};
+  for (const auto &method : backend.get_available_methods()) {
+    names.push_back(method);
+    names.push_back(method + "_params");
+  }
+  for (const auto &attribute : backend.get_settable_attributes()) {
+    names.push_back("get_" + attribute);
+    names.push_back("set_" + attribute);
+    names.push_back(attribute + "_params");
+  }
+  std::erase_if(names, [&](const std::string &name) {
+    return !module.find_method(name) && !module.hasattr(name);
+  });
+  return names;
+}
+
+// freezing inlines submodules, and folds parameters and attributes that are
+// never written into constants, e.g. batch norms into convolutions
+static torch::jit::script::Module
+freeze_for_inference(const torch::jit::script::Module &module) {
+  return torch::jit::freeze(module, preserved_attributes(module));
+}
+
+static void convert_bf16(torch::jit::script::Module &module) {
+  torch::NoGradGuard no_grad;
+  // integer buffers (e.g. method params) stay as they are
+  for (const auto &p : module.named_parameters(true))
+    if (p.value.is_floating_point())
+      p.value.set_data(p.value.to(torch::kBFloat16));
+  for (const auto &b : module.named_buffers(true))
+    if (b.value.is_floating_point())
+      b.value.set_data(b.value.to(torch::kBFloat16));
+}
+
+static void collect_linears(torch::jit::Block *block,
+                            std::vector<torch::jit::Node *> &linears) {
+  for (auto node : block->nodes()) {
+    if (node->kind() == c10::Symbol::fromQualString("aten::linear"))
+      linears.push_back(node);
+    for (auto sub_block : node->blocks())
+      collect_linears(sub_block, linears);
+  }
+}
+
+// replace linear layers with constant weights by dynamically quantized ones:
+// int8 weights, packed once, per output channel scales
+static int quantize_linears(std::shared_ptr<torch::jit::Graph> graph,
+                            bool reduce_range) {
+  static const auto prepack = c10::Dispatcher::singleton().findSchemaOrThrow(
+      "quantized::linear_prepack", "");
+  std::vector<torch::jit::Node *> linears;
+  collect_linears(graph->block(), linears);
+  int quantized = 0;
+  for (auto node : linears) {
+    auto weight = torch::jit::toIValue(node->input(1));
+    auto bias = torch::jit::toIValue(node->input(2));
+    if (!weight || !bias || !weight->isTensor())
+      continue;
+    auto w = weight->toTensor();
+    if (w.dim() != 2 || w.scalar_type() != torch::kFloat)
+      continue;
+    auto scales = w.abs().amax(1).clamp_min(1e-8).div(127).to(torch::kDouble);
+    auto zero_points = torch::zeros({w.size(0)}, torch::kLong);
+    torch::jit::Stack stack{
+        at::quantize_per_channel(w, scales, zero_points, 0, torch::kQInt8),
+        *bias};
+    prepack.callBoxed(&stack);
+
+    torch::jit::WithInsertPoint guard(node);
+    auto packed = graph->insertConstant(stack.back());
+    auto output = graph->insert(
+        c10::Symbol::fromQualString("quantized::linear_dynamic"),
+        {node->input(0), packed, reduce_range});
+    node->output()->replaceAllUsesWith(output);
+    node->destroy();
+    quantized++;
+  }
+  torch::jit::EliminateDeadCode(graph);
+  return quantized;
+}
+
+// weights are constants in frozen graphs, so that they can be packed
+static std::shared_ptr<torch::jit::script::Module>
+convert_int8(const torch::jit::script::Module &module) {
+  const auto &engines = at::globalContext().supportedQEngines();
+  auto has_engine = [&](at::QEngine engine) {
+    return std::find(engines.begin(), engines.end(), engine) != engines.end();
+  };
+  at::QEngine engine;
+  if (has_engine(at::QEngine::FBGEMM))
+    engine = at::QEngine::FBGEMM;
+  else if (has_engine(at::QEngine::QNNPACK))
+    engine = at::QEngine::QNNPACK;
+  else {
+    std::cerr << "no quantized engine in this libtorch build\n";
+    return nullptr;
+  }
+  at::globalContext().setQEngine(engine);
+
+  auto frozen = freeze_for_inference(module);
+  int quantized = 0;
+  for (const auto &method : frozen.get_methods())
+    // fbgemm: avoid overflows of int8 activation products on AVX2
+    quantized +=
+        quantize_linears(method.graph(), engine == at::QEngine::FBGEMM);
+  if (quantized == 0) {
+    std::cerr << "no linear layer to quantize\n";
+    return nullptr;
+  }
+  return std::make_shared<torch::jit::script::Module>(frozen);
+}
+
+// run each method once on silence, on a separate context: throws if the
+// converted model can't run (e.g. ops mixing fp32 and bf16 tensors)
+static void check_converted(
+    std::shared_ptr<const torch::jit::script::Module> module,
+    Precision precision) {
+  c10::InferenceMode guard;
+  Backend backend;
+  if (backend.load(module, "", precision) != 0)
+    throw std::runtime_error("can't load converted model");
+  int n_vec = backend.get_higher_ratio();
+  auto context = backend.get_model();
+  for (const auto &method : backend.get_available_methods()) {
+    auto params = backend.get_method_params(method);
+    if (params.size() < 4)
+      continue;
+    auto input = torch::zeros(
+        {1, params[0], n_vec / params[1]},
+        at::TensorOptions().dtype(precision == Precision::bf16
+                                      ? torch::kBFloat16
+                                      : torch::kFloat));
+    context.get_method(method)({input});
+  }
+}
+
+static std::shared_ptr<torch::jit::script::Module>
+convert(std::shared_ptr<torch::jit::script::Module> module,
+        Precision precision) {
+  try {
+    if (precision == Precision::bf16)
+      convert_bf16(*module);
+    else if (precision == Precision::int8)
+      module = convert_int8(*module);
+    if (module == nullptr)
+      return nullptr;
+    check_converted(module, precision);
+    return module;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+// frozen, with each exported method's graph optimized for inference
+// (e.g. oneDNN layouts for convolutions, op fusions), checked like conversions
+static std::shared_ptr<torch::jit::script::Module>
+optimize(const torch::jit::script::Module &module, Precision precision) {
+  try {
+    // int8 modules are already frozen
+    auto frozen =
+        module.hasattr("training") ? freeze_for_inference(module) : module;
+    std::vector<std::string> methods;
+    for (const auto &method : exported_methods(frozen))
+      if (method != "forward")
+        methods.push_back(method);
+    auto optimized = std::make_shared<torch::jit::script::Module>(
+        torch::jit::optimize_for_inference(frozen, methods));
+    check_converted(optimized, precision);
+    return optimized;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+// converted modules are tagged with the source model's stamp and conversions
+static std::string converted_tag(ModelStamp stamp, Precision precision,
+                                 bool optimized) {
+  return std::to_string(stamp.size) + " " + std::to_string(stamp.mtime) + " " +
+         precision_name(precision) + (optimized ? " optimized" : "");
+}
+
+static std::shared_ptr<torch::jit::script::Module>
+load_converted(const std::string &converted_file, const std::string &tag) {
+  std::error_code ec;
+  if (!std::filesystem::exists(converted_file, ec))
+    return nullptr;
+  try {
+    torch::jit::ExtraFilesMap extra{{"nn.ar-source", ""}};
+    auto model = std::make_shared<torch::jit::script::Module>(
+        torch::jit::load(converted_file, torch::kCPU, extra));
+    if (extra["nn.ar-source"] != tag)
+      return nullptr;
+    model->eval();
+    return model;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+static int process_id() {
+#if defined(_WIN32)
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+static void save_converted(const torch::jit::script::Module &module,
+                           const std::string &converted_file,
+                           const std::string &tag) {
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path(converted_file).parent_path(), ec);
+  // write aside and rename: other processes never load a partial file.
+  // Unique by process, and by thread as a server can convert from several
+  auto tmp_file = converted_file + ".tmp" + std::to_string(process_id()) +
+                  "-" +
+                  std::to_string(std::hash<std::thread::id>{}(
+                      std::this_thread::get_id()));
+  try {
+    module.save(tmp_file, {{"nn.ar-source", tag}});
+    std::filesystem::rename(tmp_file, converted_file, ec);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    ec = std::make_error_code(std::errc::io_error);
+  }
+  if (ec) {
+    std::filesystem::remove(tmp_file, ec);
+    std::cerr << "can't save converted model to " << converted_file << '\n';
+  }
+}
+
+std::shared_ptr<const torch::jit::script::Module>
+Backend::load_module(std::string path, const LoadOptions &options,
+                     Precision &precision) {
+  precision = options.precision;
+  ModelStamp stamp;
+  bool has_stamp = get_stamp(path, stamp);
+  auto tag = converted_tag(stamp, precision, options.optimize);
+  try {
+    std::shared_ptr<torch::jit::script::Module> model;
+    bool converting = precision != Precision::fp32 || options.optimize;
+    bool cache_converted =
+        has_stamp && converting && !options.converted_file.empty();
+    if (cache_converted)
+      model = load_converted(options.converted_file, tag);
+    if (model == nullptr) {
+      model =
+          std::make_shared<torch::jit::script::Module>(torch::jit::load(path));
+      model->eval();
+      // only cache modules converted as requested: failures are reported
+      // at each load
+      bool converted_all = true;
+      if (precision != Precision::fp32) {
+        auto converted = convert(model, precision);
+        if (converted == nullptr) {
+          std::cerr << "can't run " << path << " in "
+                    << precision_name(precision) << ", using fp32\n";
+          precision = Precision::fp32;
+          converted_all = false;
+          // conversion might have changed it in place
+          model = std::make_shared<torch::jit::script::Module>(
+              torch::jit::load(path));
+          model->eval();
+        } else {
+          model = converted;
+        }
+      }
+      if (options.optimize) {
+        auto optimized = optimize(*model, precision);
+        if (optimized == nullptr) {
+          std::cerr << "can't optimize " << path << ", running it as is\n";
+          converted_all = false;
+        } else {
+          model = optimized;
+        }
+      }
+      if (cache_converted && converted_all)
+        save_converted(*model, options.converted_file, tag);
+    }
+#if defined(__linux__) || defined(__APPLE__)
+    // frozen modules have no parameters left: weights are graph constants
+    bool frozen = !model->hasattr("training");
+    if (has_stamp && !frozen && !options.weights_file.empty() &&
+        !map_weights(*model, options.weights_file, stamp, options.huge_pages) &&
+        !(write_weights(*model, options.weights_file, stamp) &&
+          map_weights(*model, options.weights_file, stamp, options.huge_pages)))
+      std::cerr << "can't map weights of " << path << " from "
+                << options.weights_file << ", using private memory\n";
+#endif
+    return model;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return nullptr;
+  }
+}
+
+int Backend::load(std::shared_ptr<const torch::jit::script::Module> module,
+                  std::string path, Precision precision) {
+  if (module == nullptr)
+    return 1;
+  // shared modules live on CPU and contexts share their parameters: moving
+  // one to the gpu would move them for every Backend, so load privately
+  if (m_device != CPU)
+    return load(path);
+  try {
+    auto model = clone_context(*module);
+
+    std::unique_lock<std::mutex> model_lock(m_model_mutex);
+    m_model = model;
+    m_shared = module;
+    m_precision = precision;
     m_loaded = 1;
     model_lock.unlock();
 
@@ -106,6 +867,12 @@ int Backend::reload() {
   return return_code;
 }
 
+int Backend::reset_state() {
+  if (m_shared == nullptr)
+    return reload();
+  return load(m_shared, m_path, m_precision);
+}
+
 bool Backend::has_method(std::string method_name) {
   std::unique_lock<std::mutex> model_lock(m_model_mutex);
   for (const auto &m : m_model.get_methods()) {
@@ -326,6 +1093,33 @@ void Backend::set_attribute(std::string attribute_name,
   }
 }
 
+bool Backend::prepare_setter(PreparedSetter &setter,
+                             std::string attribute_name) {
+  setter.name = attribute_name;
+  try {
+    std::unique_lock<std::mutex> model_lock(m_model_mutex);
+    setter.method = m_model.get_method("set_" + attribute_name);
+    return true;
+  } catch (...) {
+    setter.method.reset();
+    return false;
+  }
+}
+
+void Backend::set_attribute(PreparedSetter &setter,
+                            std::vector<c10::IValue> attribute_args) {
+  if (!setter.method)
+    throw "setter for attribute " + setter.name + " not found in model";
+  try {
+    int setter_result = (*setter.method)(std::move(attribute_args)).toInt();
+    if (setter_result != 0) {
+      throw "setter returned -1";
+    }
+  } catch (...) {
+    throw "setter for " + setter.name + " failed";
+  }
+}
+
 std::vector<int> Backend::get_method_params(std::string method) {
   std::vector<int> params;
 
@@ -355,6 +1149,27 @@ int Backend::get_higher_ratio() {
   return higher_ratio;
 }
 
+void Backend::set_intra_op_threads(int n_threads) {
+  static const int default_threads = at::get_num_threads();
+  thread_local int current_threads = 0;
+  if (n_threads <= 0)
+    n_threads = default_threads;
+  if (n_threads == current_threads)
+    return;
+  at::set_num_threads(n_threads);
+  current_threads = n_threads;
+}
+
+bool Backend::set_inter_op_threads(int n_threads) {
+  try {
+    at::set_num_interop_threads(n_threads);
+    return true;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return false;
+  }
+}
+
 bool Backend::is_loaded() { return m_loaded; }
 
 void Backend::use_gpu(bool value) {
@@ -373,5 +1188,10 @@ void Backend::use_gpu(bool value) {
   } else {
     m_device = CPU;
   }
+  if (m_shared != nullptr && m_device != CPU) {
+    model_lock.unlock();
+    load(m_path);
+    return;
+  }
   m_model.to(m_device);
 }
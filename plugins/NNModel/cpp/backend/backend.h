@@ -1,10 +1,87 @@
 #pragma once
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <torch/script.h>
 #include <torch/torch.h>
 #include <vector>
 
+// time spent in each step of the last perform call
+struct PerformTimings {
+  // wrapping the input buffer and copying it to the device tensor
+  std::chrono::steady_clock::duration input{};
+  // the TorchScript method call
+  std::chrono::steady_clock::duration forward{};
+  // checking output shape and copying it back to the output buffer
+  std::chrono::steady_clock::duration output{};
+};
+
+// a model method resolved once, with its input preallocated for a given
+// buffer size and number of batches, so that performing it needs no lookup
+struct PreparedMethod {
+  std::optional<torch::jit::Method> method;
+  int in_dim, in_ratio, out_dim, out_ratio;
+  int n_vec, n_batches;
+  // buffers hold model rate frames only: n_vec / in_ratio input frames,
+  // n_vec / out_ratio output frames per channel
+  bool decimated = false;
+  at::Tensor in_tensor;
+  PerformTimings timings;
+
+  // frames per channel in the buffers passed to perform
+  int in_frames() const { return decimated ? n_vec / in_ratio : n_vec; }
+  int out_frames() const { return decimated ? n_vec / out_ratio : n_vec; }
+};
+
+// an attribute setter resolved once, to be called with typed arguments
+struct PreparedSetter {
+  std::optional<torch::jit::Method> method;
+  std::string name;
+};
+
+// numeric precision models run in, on CPU
+enum class Precision {
+  fp32,
+  // parameters, buffers and inputs in bfloat16: fast on CPUs with native
+  // bf16 (AVX512-BF16, AMX, ARMv8.6), emulated and slower elsewhere
+  bf16,
+  // dynamic quantization: linear layers with int8 weights, activations
+  // quantized on the fly
+  int8
+};
+
+// how a module is loaded and converted before being shared
+struct LoadOptions {
+  Precision precision = Precision::fp32;
+  // freeze the module and optimize its methods' graphs for inference
+  bool optimize = false;
+  // converted modules are saved here, and loaded from here while the model
+  // file doesn't change. Empty: convert at each load
+  std::string converted_file;
+  // parameters backed by a memory mapped copy in this file, written on first
+  // load: their pages are shared with all processes mapping the same file.
+  // Empty: private memory
+  std::string weights_file;
+  // copy mapped parameters to anonymous memory backed by huge pages (Linux):
+  // not shared with other processes anymore
+  bool huge_pages = false;
+};
+
+// TorchScript executor settings for a model, applied while warming it up:
+// methods are profiled and optimized during their first calls.
+// -1: libtorch default
+struct JitSettings {
+  // 1: profiling executor, specializing graphs on the shapes it sees.
+  // 0: simple executor, optimizing graphs without profiling
+  int profiling = -1;
+  // fusion of specialized graphs, 0: for static shapes, 1: dynamic shapes
+  int fusion = -1;
+  // number of specializations before falling back to a generic graph
+  int bailout_depth = -1;
+};
+
 class Backend {
 protected:
   torch::jit::script::Module m_model;
@@ -14,11 +91,46 @@ protected:
   std::vector<std::string> m_available_methods;
   c10::DeviceType m_device;
   bool m_use_gpu;
+  // keeps shared weights alive when loaded from a shared module
+  std::shared_ptr<const torch::jit::script::Module> m_shared;
+  // precision of the shared module, inputs are converted to it
+  Precision m_precision;
+
+  // call a prepared method on its input tensor, recording its time
+  at::Tensor forward(PreparedMethod &prepared);
 
 public:
   Backend();
-  void perform(std::vector<float *> in_buffer, std::vector<float *> out_buffer,
-               int n_vec, std::string method, int n_batches);
+  // in_buffer: [in_dim * n_batches][n_vec], interlaced by dim
+  // out_buffer: [n_batches * out_dim][n_vec], grouped by batch
+  void perform(const float *in_buffer, float *out_buffer, int n_vec,
+               std::string method, int n_batches);
+  // params: in_dim, in_ratio, out_dim, out_ratio (see get_method_params).
+  // decimated: see PreparedMethod
+  bool prepare(PreparedMethod &prepared, std::string method,
+               const std::vector<int> &params, int n_vec, int n_batches,
+               bool decimated = false);
+  // perform a prepared method, same buffer layout as above.
+  // Doesn't lock the model: don't reload while performing
+  void perform(PreparedMethod &prepared, const float *in_buffer,
+               float *out_buffer);
+  // chained methods: the first one takes its input from a buffer, the next
+  // ones take the previous one's output tensor, kept in libtorch memory, and
+  // the last one writes its output to a buffer. Same layouts as perform.
+  // Return an undefined tensor on errors, timings are reset by each call
+  at::Tensor perform_tensor(PreparedMethod &prepared, const float *in_buffer);
+  at::Tensor perform_tensor(PreparedMethod &prepared, const at::Tensor &in);
+  bool write_output(PreparedMethod &prepared, const at::Tensor &out,
+                    float *out_buffer);
+  // perform a prepared method on silence, with its own shapes, until its call
+  // time is stable: at least min_passes and at most max_passes times.
+  // Returns the number of passes, prepared.timings has the last call's.
+  // Warmups are serialized, since jit settings are global to libtorch, and
+  // make at least the calls optimizing the method, even with min_passes 0
+  // if jit has settings: unwarmed methods are optimized by their first
+  // calls with the settings in effect
+  int warmup(PreparedMethod &prepared, const JitSettings &jit, int min_passes,
+             int max_passes = 32);
   bool has_method(std::string method_name);
   bool has_settable_attribute(std::string attribute);
   std::vector<std::string> get_available_methods();
@@ -28,11 +140,39 @@ public:
   std::string get_attribute_as_string(std::string attribute_name);
   void set_attribute(std::string attribute_name,
                      std::vector<std::string> attribute_args);
+  bool prepare_setter(PreparedSetter &setter, std::string attribute_name);
+  // call a prepared setter, arguments must already be of the right type.
+  // Doesn't lock the model: don't reload while setting
+  void set_attribute(PreparedSetter &setter,
+                     std::vector<c10::IValue> attribute_args);
 
   std::vector<int> get_method_params(std::string method);
   int get_higher_ratio();
   int load(std::string path);
+  // load an independent execution context for a module shared between
+  // Backends: parameters are shared, buffers and attributes are copied
+  // precision must be the one module was loaded with (see load_module).
+  // Shared modules are on CPU: when using the gpu, path is loaded privately
+  int load(std::shared_ptr<const torch::jit::script::Module> module,
+           std::string path, Precision precision = Precision::fp32);
+  static std::shared_ptr<const torch::jit::script::Module>
+  load_module(std::string path, c10::DeviceType device = torch::kCPU);
+  // same, on CPU, converted, optimized and mapped as set by options. Falls
+  // back to fp32 if the model can't run converted, to the model as is if it
+  // can't be optimized, and to private memory if mapping isn't possible:
+  // precision is set to the one actually used
+  static std::shared_ptr<const torch::jit::script::Module>
+  load_module(std::string path, const LoadOptions &options,
+              Precision &precision);
   int reload();
+  // drop per-instance state (e.g. streaming buffers): a fresh execution
+  // context of the shared module, or a reload if not loaded from one
+  int reset_state();
+  // libtorch thread settings: intra-op threads apply to the calling thread
+  // with OpenMP builds, globally otherwise. n_threads <= 0: libtorch default
+  static void set_intra_op_threads(int n_threads);
+  // can only be set once, before any inter-op parallel work
+  static bool set_inter_op_threads(int n_threads);
   bool is_loaded();
   torch::jit::script::Module get_model() { return m_model; }
   void use_gpu(bool value);
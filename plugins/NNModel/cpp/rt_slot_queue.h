@@ -0,0 +1,148 @@
+/*
+* lock-free handoff between the audio thread and a compute thread
+* SlotQueue operates on already allocated buffers
+* so that they can be allocated via RTAlloc on the real-time memory
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+namespace NN {
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+// wakes up a waiting thread: the waiter spins for a short time,
+// then sleeps on the atomic (a futex on linux) until notified
+class HybridEvent {
+public:
+  // read before checking for work, then pass to wait
+  uint32_t epoch() const { return m_epoch.load(std::memory_order_acquire); }
+
+  // lock-free, can be called on the audio thread.
+  // Only signals the condition variable while someone waits with a deadline
+  void notify() {
+    m_epoch.fetch_add(1, std::memory_order_release);
+    m_epoch.notify_one();
+    if (m_timedWaiters.load(std::memory_order_acquire) > 0) m_cond.notify_all();
+  }
+
+  // wait for a notification posted after lastEpoch was read, sleeping until
+  // deadline at most. The notifier doesn't lock: a notification posted right
+  // before sleeping can be missed, and only delays the waiter until deadline.
+  // Returns false on timeout
+  template <class TimePoint>
+  bool waitUntil(uint32_t lastEpoch, TimePoint deadline) const {
+    auto notified = [&] { return epoch() != lastEpoch; };
+    if (notified()) return true;
+    m_timedWaiters.fetch_add(1, std::memory_order_acq_rel);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool result = m_cond.wait_until(lock, deadline, notified);
+    m_timedWaiters.fetch_sub(1, std::memory_order_release);
+    return result;
+  }
+
+  // wait for a notification posted after lastEpoch was read
+  template <class Duration>
+  void wait(uint32_t lastEpoch, Duration spinTime) const {
+    auto spinEnd = std::chrono::steady_clock::now() + spinTime;
+    do {
+      for (int i = 0; i < 64; ++i) {
+        if (epoch() != lastEpoch) return;
+        cpuRelax();
+      }
+    } while (std::chrono::steady_clock::now() < spinEnd);
+    m_epoch.wait(lastEpoch, std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<uint32_t> m_epoch = 0;
+  // for waitUntil
+  mutable std::atomic<int> m_timedWaiters = 0;
+  mutable std::mutex m_mutex;
+  mutable std::condition_variable m_cond;
+};
+
+// single-producer single-consumer queue of preallocated processing slots.
+// The producer (audio thread) fills a slot's input and submits it,
+// the consumer (compute thread) processes it and completes it,
+// then the producer reads its output and releases the slot.
+// Each submitted slot carries the time by which its output is needed.
+// There is one more input than output slot: the producer fills the next
+// input in place while all others are in flight.
+class SlotQueue {
+public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr int maxDepth = 16;
+
+  SlotQueue(int depth, float* inData, size_t inSize, float* outData, size_t outSize):
+    m_depth(depth), m_inData(inData), m_inSize(inSize),
+    m_outData(outData), m_outSize(outSize) {}
+
+  int depth() const { return m_depth; }
+  int inputSlots() const { return m_depth + 1; }
+  float* input(int slot) const { return m_inData + m_inSize * slot; }
+  float* output(int slot) const { return m_outData + m_outSize * slot; }
+
+  // producer side
+  bool canSubmit() const {
+    return m_submitted.load(std::memory_order_relaxed) - m_released < static_cast<uint64_t>(m_depth);
+  }
+  int nextInputSlot() const { return static_cast<int>(m_submitted.load(std::memory_order_relaxed) % inputSlots()); }
+  float* nextInput() const { return input(nextInputSlot()); }
+  void submit(Clock::time_point deadline) {
+    m_deadlines[m_submitted.load(std::memory_order_relaxed) % m_depth] = deadline;
+    m_submitted.fetch_add(1, std::memory_order_release);
+  }
+  bool hasResult() const { return m_completed.load(std::memory_order_acquire) != m_released; }
+  float* nextOutput() const { return output(m_released % m_depth); }
+  // input slot the next output was computed from, to look up its window's data
+  int resultInputSlot() const { return static_cast<int>(m_released % inputSlots()); }
+  void release() { m_released++; }
+  // block until a result is available, for producers without deadline (NRT)
+  void waitResult() const {
+    while (!hasResult()) m_completed.wait(m_released, std::memory_order_acquire);
+  }
+  // number of submitted slots not yet released
+  int inFlight() const { return static_cast<int>(m_submitted.load(std::memory_order_relaxed) - m_released); }
+
+  // consumer side
+  bool hasPending() const {
+    return m_submitted.load(std::memory_order_acquire) != m_completed.load(std::memory_order_relaxed);
+  }
+  int pendingInputSlot() const { return static_cast<int>(m_completed.load(std::memory_order_relaxed) % inputSlots()); }
+  float* pendingInput() const { return input(pendingInputSlot()); }
+  float* pendingOutput() const { return output(m_completed.load(std::memory_order_relaxed) % m_depth); }
+  Clock::time_point pendingDeadline() const { return m_deadlines[m_completed.load(std::memory_order_relaxed) % m_depth]; }
+  void complete() {
+    m_completed.fetch_add(1, std::memory_order_release);
+    m_completed.notify_one();
+  }
+
+private:
+  int m_depth;
+  float* m_inData;
+  size_t m_inSize;
+  float* m_outData;
+  size_t m_outSize;
+  Clock::time_point m_deadlines[maxDepth];
+
+  std::atomic<uint64_t> m_submitted = 0;
+  std::atomic<uint64_t> m_completed = 0;
+  // only accessed by the producer
+  uint64_t m_released = 0;
+};
+
+} // namespace NN
@@ -42,7 +42,7 @@ NN {
 		};
 	}
 
-	*load { |key, path, id(-1), server(Server.default), action|
+	*load { |key, path, id(-1), server(Server.default), action, intraOpThreads(0), precision(\fp32), optimize(false)|
 		var model = this.model(key);
 		if (path.isKindOf(String).not) {
 			Error("NN.load: path needs to be a string, got: %".format(path)).throw
@@ -58,7 +58,7 @@ NN {
 			this.prPutModel(key, m);
 				// call action after adding to registry: in case action needs key
 				action.value(m);
-			});
+			}, intraOpThreads: intraOpThreads, precision: precision, optimize: optimize);
 		};
 		if (this.isNRT) {
 			server.sendMsg(*model.loadMsg);
@@ -74,13 +74,77 @@ NN {
 		}
 	}
 
-	*loadMsg { |id, path, infoFile|
+	*loadMsg { |id, path, infoFile, intraOpThreads(0), precision(\fp32), optimize(false)|
+		// precisions, see Precision in backend.h
+		var precisions = (fp32: 0, bf16: 1, int8: 2);
+		var precisionIdx = precisions[precision] ?? {
+			Error("NN: unknown precision '%'".format(precision)).throw
+		};
 		path = path !? { path.standardizePath };
 		infoFile = infoFile !? { infoFile.standardizePath };
-		^["/cmd", "/nn_load", id, path, infoFile]
+		^["/cmd", "/nn_load", id, path, infoFile ? "", intraOpThreads, precisionIdx, optimize.asInteger]
 	}
 	*dumpInfoMsg { |modelIdx, outFile|
 		^["/cmd", "/nn_query", modelIdx ? -1, outFile ? ""]
 	}
+	*setThreads { |numWorkers(0), cpus, rtPolicy, rtPriority(0), intraOpThreads(0), interOpThreads(0), lockMemory(false), server(Server.default)|
+		server.sendMsg(*this.threadsMsg(numWorkers, cpus, rtPolicy, rtPriority, intraOpThreads, interOpThreads, lockMemory))
+	}
+	*threadsMsg { |numWorkers(0), cpus, rtPolicy, rtPriority(0), intraOpThreads(0), interOpThreads(0), lockMemory(false)|
+		// policies, see NNSchedPolicy
+		var policies = (fifo: 1, rr: 2);
+		var policy = rtPolicy !? {
+			policies[rtPolicy] ?? { Error("NN: unknown rtPolicy '%'".format(rtPolicy)).throw }
+		} ? 0;
+		if (cpus.isString.not and: { cpus.isSequenceableCollection }) { cpus = cpus.join(",") };
+		^["/cmd", "/nn_threads", numWorkers, cpus ? "", policy, rtPriority, intraOpThreads, interOpThreads, lockMemory.asInteger]
+	}
+
+	// where the server caches model info, nil to disable
+	*setCacheDir { |dir, server(Server.default)|
+		server.sendMsg(*this.cacheDirMsg(dir))
+	}
+	*cacheDirMsg { |dir|
+		dir = dir !? { dir.standardizePath };
+		^["/cmd", "/nn_cache_dir", dir ? ""]
+	}
+
+	*mapWeights { |enable(true), hugePages(false), server(Server.default)|
+		server.sendMsg(*this.mapWeightsMsg(enable, hugePages))
+	}
+	*mapWeightsMsg { |enable(true), hugePages(false)|
+		^["/cmd", "/nn_weights", enable.asInteger, hugePages.asInteger]
+	}
+
+	*dumpStats { |outFile, reset(false), server(Server.default)|
+		forkIfNeeded {
+			server.sync(bundles:[this.statsMsg(-1, outFile, reset)])
+		}
+	}
+	*statsMsg { |modelIdx, outFile, reset(false)|
+		outFile = outFile !? { outFile.standardizePath };
+		^["/cmd", "/nn_stats", modelIdx ? -1, outFile ? "", reset.asInteger]
+	}
+	*warmupMsg { |modelIdx, methodIdx, bufferSize(-1), batches(1), count(1), passes(1)|
+		^["/cmd", "/nn_warmup", modelIdx, methodIdx, bufferSize, batches, count, passes]
+	}
+	*jitMsg { |modelIdx, profiling, fusion, bailoutDepth|
+		var fusions = (static: 0, dynamic: 1);
+		var fusionIdx = fusion !? {
+			fusions[fusion] ?? { Error("NN: unknown fusion '%'".format(fusion)).throw }
+		} ? -1;
+		^["/cmd", "/nn_jit", modelIdx, profiling !? (_.asInteger) ? -1, fusionIdx, bailoutDepth ? -1]
+	}
+	*processBufMsg { |id, modelIdx, methodIdx, srcBufnum, dstBufnum, batches(1), chunkSize(65536)|
+		^["/cmd", "/nn_process_buf", id, modelIdx, methodIdx, srcBufnum, dstBufnum, batches, chunkSize]
+	}
+	*overloadMsg { |modelIdx, policy, missThreshold(4), shedTime(2)|
+		// policy flags, see NNOverloadPolicy
+		var flags = (hold: 1, shed: 2, refuse: 4);
+		var policyInt = policy.asArray.inject(0) { |acc, p|
+			acc | (flags[p] ?? { Error("NN: unknown overload policy '%'".format(p)).throw })
+		};
+		^["/cmd", "/nn_overload", modelIdx, policyInt, missThreshold, shedTime]
+	}
 
 }
@@ -23,7 +23,7 @@ NNModel {
 		^this.methods.detect { |m| m.name == name };
 	}
 
-	*load { |path, id(-1), server(Server.default), action|
+	*load { |path, id(-1), server(Server.default), action, intraOpThreads(0), precision(\fp32), optimize(false)|
 		var loadMsg, infoFile, model;
 		path = path.standardizePath;
 		if (server.serverRunning.not) {
@@ -34,7 +34,7 @@ NNModel {
 		};
 
 		infoFile = infoFile ?? {PathName.tmp +/+ "nn-sc-" ++ UniqueID.next ++ ".yaml"};
-		loadMsg = NN.loadMsg(id, path, infoFile);
+		loadMsg = NN.loadMsg(id, path, infoFile, intraOpThreads, precision, optimize);
 
 		model = super.newCopyArgs(server);
 
@@ -80,6 +80,100 @@ NNModel {
 		^NN.loadMsg(idx, newPath ? path, infoFile)
 	}
 
+	statsMsg { |outFile, reset(false)| ^NN.statsMsg(this.idx, outFile, reset) }
+	dumpStats { |outFile, reset(false)|
+		var msg = this.statsMsg(outFile, reset);
+		this.prErrIfNoServer("dumpStats");
+		if (server.serverRunning.not) { Error("server not running").throw };
+		forkIfNeeded { server.sync(bundles:[msg]) }
+	}
+	// read stats from the server, action is called with a Dictionary
+	stats { |action, reset(false)|
+		var statsFile = PathName.tmp +/+ "nn-sc-stats-" ++ UniqueID.next ++ ".yaml";
+		this.prErrIfNoServer("stats");
+		forkIfNeeded {
+			server.sync(bundles:[this.statsMsg(statsFile, reset)]);
+			protect {
+				var stats = File.readAllString(statsFile).parseYAML;
+				action.(stats.first)
+			} {
+				File.delete(statsFile);
+			}
+		}
+	}
+
+	overloadMsg { |policy, missThreshold(4), shedTime(2)|
+		^NN.overloadMsg(this.idx, policy, missThreshold, shedTime)
+	}
+	setOverload { |policy, missThreshold(4), shedTime(2)|
+		this.prErrIfNoServer("setOverload");
+		server.sendMsg(*this.overloadMsg(policy, missThreshold, shedTime));
+	}
+
+	jitMsg { |profiling, fusion, bailoutDepth|
+		^NN.jitMsg(this.idx, profiling, fusion, bailoutDepth)
+	}
+	// TorchScript executor settings, used when warming up this model's methods
+	setJit { |profiling, fusion, bailoutDepth|
+		this.prErrIfNoServer("setJit");
+		server.sendMsg(*this.jitMsg(profiling, fusion, bailoutDepth));
+	}
+
+	warmupMsg { |methodName, bufferSize(-1), batches(1), count(1), passes(1)|
+		var method = this.method(methodName) ?? {
+			Error("NNModel(%): method '%' not found".format(this.key, methodName)).throw
+		};
+		^NN.warmupMsg(this.idx, method.idx, bufferSize, batches, count, passes)
+	}
+	// keep count instances of methodName loaded and warmed up, for new UGens to adopt
+	warmup { |methodName, bufferSize(-1), batches(1), count(1), passes(1), action|
+		var msg = this.warmupMsg(methodName, bufferSize, batches, count, passes);
+		this.prErrIfNoServer("warmup");
+		forkIfNeeded {
+			server.sync(bundles:[msg]);
+			action.(this)
+		}
+	}
+
+	processBufMsg { |methodName, src, dst, batches(1), chunkSize(65536), id(-1)|
+		var method = this.method(methodName) ?? {
+			Error("NNModel(%): method '%' not found".format(this.key, methodName)).throw
+		};
+		^NN.processBufMsg(id, this.idx, method.idx, src.asUGenInput, dst.asUGenInput, batches, chunkSize)
+	}
+	// process src through methodName into dst, in the background on the server.
+	// dst is allocated if nil. action is called with dst when done,
+	// progressAction with the fraction processed so far
+	processBuf { |methodName, src, dst, action, batches(1), chunkSize(65536), progressAction|
+		var method = this.method(methodName) ?? {
+			Error("NNModel(%): method '%' not found".format(this.key, methodName)).throw
+		};
+		var id = UniqueID.next;
+		this.prErrIfNoServer("processBuf");
+		dst = dst ?? { Buffer.alloc(server, src.numFrames, method.numOutputs) };
+		forkIfNeeded {
+			var replies;
+			server.sync;
+			// replies come from the root group: [cmd, 0, id, progress]
+			replies = OSCFunc({ |msg|
+				var progress = msg[3];
+				case
+				{ progress < 0 } {
+					replies.free;
+					"NNModel(%): processBuf failed".format(this.key).warn;
+				}
+				{ progress >= 1 } {
+					replies.free;
+					action.(dst);
+				} {
+					progressAction.(progress)
+				}
+			}, '/nn_process_buf', server.addr, argTemplate: [0, id]);
+			server.sendMsg(*this.processBufMsg(methodName, src, dst, batches, chunkSize, id));
+		};
+		^dst
+	}
+
 	dumpInfoMsg { |outFile| ^NN.dumpInfoMsg(this.idx, outFile) }
 	dumpInfo { |outFile|
 		var msg = this.dumpInfoMsg(outFile);
@@ -1,15 +1,22 @@
 NNUGen : MultiOutUGen {
 
-	// enum UGenInputs { modelIdx=0, methodIdx, bufSize, warmup, debug, nBatches, inputs };
+	// enum UGenInputs { modelIdx=0, methodIdx, bufSize, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interp, inBuf, outBuf, bufLoop, chainLength, adaptMargin, inputs };
 	// todo: clump batches
-	*ar { |modelIdx, methodIdx, bufferSize, numOutputs, warmup, debug, nBatches, inputs|
-		^this.new1('audio', modelIdx, methodIdx, bufferSize, warmup, debug, nBatches, *inputs)
+	*ar { |modelIdx, methodIdx, bufferSize, numOutputs, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chainLength, adaptMargin, inputs|
+		^this.new1('audio', modelIdx, methodIdx, bufferSize, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chainLength, adaptMargin, *inputs)
 			.initOutputs(numOutputs * nBatches, 'audio');
 	}
 
+	// one output value per control block, e.g. for latents
+	*kr { |modelIdx, methodIdx, bufferSize, numOutputs, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chainLength, adaptMargin, inputs|
+		^this.new1('control', modelIdx, methodIdx, bufferSize, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chainLength, adaptMargin, *inputs)
+			.initOutputs(numOutputs * nBatches, 'control');
+	}
+
 	checkInputs {
-		// modelIdx, methodIdx and bufferSize are not modulatable
-		['modelIdx', 'methodIdx', 'bufferSize'].do { |name, n|
+		// modelIdx, methodIdx, bufferSize, sharedBatches, queueDepth, interp, buffers, chain and adaptive are not modulatable
+		['modelIdx', 0, 'methodIdx', 1, 'bufferSize', 2, 'sharedBatches', 6, 'queueDepth', 7, 'interp', 9,
+			'inBuffer', 10, 'outBuffer', 11, 'loop', 12, 'chainLength', 13, 'adaptive', 14].pairsDo { |name, n|
 		if (inputs[n].rate != \scalar) {
 				^": '%' is not modulatable. Got: %.".format(name, inputs[n]);	
 			}
@@ -19,9 +26,24 @@ NNUGen : MultiOutUGen {
 }
 
 +NNModelMethod {
-	ar { |inputs, bufferSize=(-1), warmup=0, debug=0, attributes(#[])|
-		var attrParams, nBatches, outputs;
+	ar { |inputs, bufferSize=(-1), warmup=0, debug=0, attributes(#[]), sharedBatches=0, queueDepth=2, priority=0, interp(\hold), inBuffer, outBuffer, loop=1, chain, adaptive=false|
+		^this.prUGen(\ar, inputs, bufferSize, warmup, debug, attributes, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chain, adaptive)
+	}
+
+	kr { |inputs, bufferSize=(-1), warmup=0, debug=0, attributes(#[]), sharedBatches=0, queueDepth=2, priority=0, interp(\hold), inBuffer, outBuffer, loop=1, chain, adaptive=false|
+		^this.prUGen(\kr, inputs, bufferSize, warmup, debug, attributes, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chain, adaptive)
+	}
+
+	prUGen { |selector, inputs, bufferSize, warmup, debug, attributes, sharedBatches, queueDepth, priority, interp, inBuffer, outBuffer, loop, chain, adaptive|
+		// interpolations, see Interp in NNUGens.hpp
+		var interps = (hold: 0, linear: 1, lowpass: 2);
+		var attrParams, chainParams, outMethod = this, nBatches, outputs, interpIdx, adaptMargin;
+		// inputs can be omitted when read from a buffer
+		if (inputs.isNil && inBuffer.notNil) { inputs = 0 ! this.numInputs };
 		inputs = inputs.asArray;
+		interpIdx = interps[interp] ?? {
+			Error("NNModelMethod: unknown interp '%'".format(interp)).throw
+		};
 
 
 		case { inputs.rank == 1 && {inputs.size == this.numInputs} } {
@@ -46,12 +68,35 @@ NNUGen : MultiOutUGen {
 			attrParams.add(attrValue ?? 0);
 		};
 
-		outputs = NNUGen.ar(model.idx, idx, bufferSize, this.numOutputs, warmup, debug, nBatches, inputs ++ attrParams);
+		// methods performed on the previous one's outputs, in the same computation:
+		// each a method, or [method, scale, offset] modulating its inputs
+		chain = chain.asArray;
+		chainParams = chain.collect { |stage|
+			var method, scale, offset;
+			#method, scale, offset = stage.asArray;
+			if (method.numInputs != outMethod.numOutputs) {
+				Error("NNModel: method % has % inputs, but % has % outputs."
+					.format(method.name, method.numInputs, outMethod.name, outMethod.numOutputs)).throw
+			};
+			outMethod = method;
+			[method.model.idx, method.idx,
+				(scale ? 1).asArray.wrapExtend(method.numInputs),
+				(offset ? 0).asArray.wrapExtend(method.numInputs)]
+		}.flatten(2);
+
+		// safety margin against deadlines, -1: fixed bufferSize
+		adaptMargin = case
+			{ adaptive == true } { 0.25 }
+			{ adaptive.isNumber } { adaptive.clip(0, 0.9) }
+			{ -1 };
+
+		outputs = NNUGen.perform(selector, model.idx, idx, bufferSize, outMethod.numOutputs, warmup, debug, nBatches, sharedBatches, queueDepth, priority, interpIdx,
+			inBuffer ? -1, outBuffer ? -1, loop.asInteger, chain.size, adaptMargin, inputs ++ chainParams ++ attrParams);
 		// ugen outputs interlaced batched outputs: unlace
 		// e.g. a0, b0, a1, b1 ... -> unlace to [[a0,a1], [b0,b1]]
 		if (nBatches > 1) {
 			outputs = outputs.unlace(nBatches);
-			if (this.numOutputs == 1) {
+			if (outMethod.numOutputs == 1) {
 				// flat [[a0], [b0]] to [a0, b0]
 				outputs = outputs.flatten;
 			}
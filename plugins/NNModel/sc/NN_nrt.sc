@@ -41,6 +41,12 @@ NNNRTEnv {
 		^currentEnvironment[\nn_nrt].modelsInfo;
 	}
 
+	// NRT UGens created after this message process window seconds per call,
+	// in parallel on the server's computation threads. 0: their bufferSize
+	*nrtWindowMsg { |window(0)|
+		^["/cmd", "/nn_nrt", window]
+	}
+
 	*nextModelID {
 		if (this.isNRT.not) { ^nil };
 		^currentEnvironment[\nn_nrt].modelAllocator.alloc;
@@ -50,16 +56,23 @@ NNNRTEnv {
 
 + NNModel {
 
-	nrtResynth { |bufPath, dstPath, bufferSize=0|
+	// window: seconds processed per model call (see NN.nrtWindowMsg),
+	// 0 to process bufferSize samples at a time
+	nrtResynth { |bufPath, dstPath, bufferSize=0, window=0|
 		var startTime = Date.getDate.rawSeconds;
-		var sampleRate, nch, duration;
+		var sampleRate, nch, duration, latency, memSize;
 		SoundFile.use(bufPath) { |sf|
 			sampleRate = sf.sampleRate;
 			nch = sf.numChannels;
 			duration = sf.duration;
 		};
+		// large windows are delayed by one more window while they're computed
+		latency = if (window > 0) { 2 * (window + (this.minBufferSize / sampleRate)) } { bufferSize / sampleRate };
+		// per channel: input ring, output ring and two queue slots each way, in floats
+		memSize = 8192 + (nch * 7 * 4 * (window * sampleRate + this.minBufferSize) / 1024).ceil.asInteger;
 
 		Score([
+			[0.0, NN.nrtWindowMsg(window)],
 			[0.0, this.loadMsg],
 			[0.0, ["/d_recv", SynthDef(\resynth) { |out=0|
 				Out.ar(out, SoundIn.ar((0..nch)).collect { |ch|
@@ -67,7 +80,7 @@ NNNRTEnv {
 				})
 				}.asBytes]],
 			[0.0, Synth.basicNew(\resynth).newMsg],
-			[duration + (bufferSize / sampleRate)]
+			[duration + latency]
 			]).recordNRT(
 		inputFilePath: bufPath,
 				outputFilePath: dstPath,
@@ -77,6 +90,7 @@ NNNRTEnv {
 				action: { "done in %".format(Date.getDate.rawSeconds - startTime).postln },
 				options: ServerOptions()
 					.numInputBusChannels_(nch).numOutputBusChannels_(nch)
+					.memSize_(memSize)
 		)
 	}
 }